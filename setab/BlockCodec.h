@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#pragma once
+
+#include "setab/Util.h"
+
+#include <cstring>
+
+#include <folly/Range.h>
+
+/**
+ * Encodings for compressing the columns of a sealed block. Everything is
+ * written and read back by the same process, so the decoders trust their
+ * input.
+ *
+ *   Integers: the first value, then the difference from the previous one,
+ *             each zigzagged and written as a LEB128 varint.
+ *   Text:     a byte for the encoding, and a varint for the total length.
+ *             TEXT_DICTIONARY then has a varint count of distinct values,
+ *             each as a varint length and bytes, then a varint index per row.
+ *             TEXT_RAW has a varint length per row, then all the bytes.
+ *   Codes:    for a TEXT column interned in a TextDictionary, a varint per row.
+ */
+namespace codec {
+
+enum TextEncoding : uint8_t {
+    TEXT_RAW = 0,
+    TEXT_DICTIONARY = 1,
+};
+
+inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline uint64_t readVarint(const char*& pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (true) {
+        uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+        shift += 7;
+    }
+}
+
+inline void appendDeltas(string& out, const int64_t* values, size_t count) {
+    int64_t prev = 0;
+    for (size_t i = 0; i < count; i++) {
+        // Wrapping subtraction, so that any pair of values round trips.
+        appendVarint(out, zigzag(static_cast<int64_t>(static_cast<uint64_t>(values[i]) - static_cast<uint64_t>(prev))));
+        prev = values[i];
+    }
+}
+
+inline void readDeltas(const char*& pos, int64_t* values, size_t count) {
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; i++) {
+        prev += static_cast<uint64_t>(unzigzag(readVarint(pos)));
+        values[i] = static_cast<int64_t>(prev);
+    }
+}
+
+// Codes into a column's TextDictionary, one varint per row.
+inline void appendCodes(string& out, const uint32_t* codes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        appendVarint(out, codes[i]);
+    }
+}
+
+inline void readCodes(const char*& pos, uint32_t* codes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        codes[i] = static_cast<uint32_t>(readVarint(pos));
+    }
+}
+
+// FNV-1a, for building dictionaries without copying the text.
+struct TextHash {
+    size_t operator()(folly::StringPiece value) const {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : value) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+};
+
+// Encodes `count` values, where value i is bytes[ends[i-1], ends[i]).
+// A dictionary is used when it's at least a quarter smaller.
+inline void appendText(string& out, const uint32_t* ends, const char* bytes, size_t count) {
+    size_t total = count == 0 ? 0 : ends[count-1];
+    std::unordered_map<folly::StringPiece, uint32_t, TextHash> ids;
+    vector<folly::StringPiece> values;
+    size_t dictionaryBytes = 0;
+    uint32_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        folly::StringPiece value(bytes + start, ends[i] - start);
+        start = ends[i];
+        if (ids.emplace(value, values.size()).second) {
+            values.push_back(value);
+            dictionaryBytes += value.size() + 1;
+        }
+        dictionaryBytes += 1;
+    }
+
+    bool dictionary = 4 * dictionaryBytes < 3 * (total + count);
+    out.push_back(static_cast<char>(dictionary ? TEXT_DICTIONARY : TEXT_RAW));
+    appendVarint(out, total);
+    if (dictionary) {
+        appendVarint(out, values.size());
+        for (const auto& value : values) {
+            appendVarint(out, value.size());
+            out.append(value.data(), value.size());
+        }
+    }
+    start = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (dictionary) {
+            appendVarint(out, ids[folly::StringPiece(bytes + start, ends[i] - start)]);
+        } else {
+            appendVarint(out, ends[i] - start);
+        }
+        start = ends[i];
+    }
+    if (!dictionary) {
+        out.append(bytes, total);
+    }
+}
+
+// The total length of the text column starting at `pos`.
+inline size_t textBytes(const char* pos) {
+    pos++;
+    return readVarint(pos);
+}
+
+// Decodes a column written by appendText() into `ends` and `bytes`, which
+// must have room for textBytes() bytes.
+inline void readText(const char*& pos, uint32_t* ends, char* bytes, size_t count) {
+    auto encoding = static_cast<TextEncoding>(*pos++);
+    readVarint(pos); /* total length */
+    uint32_t end = 0;
+    if (encoding == TEXT_DICTIONARY) {
+        vector<folly::StringPiece> values(readVarint(pos));
+        for (auto& value : values) {
+            size_t len = readVarint(pos);
+            value = folly::StringPiece(pos, len);
+            pos += len;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const auto& value = values[readVarint(pos)];
+            std::memcpy(bytes + end, value.data(), value.size());
+            end += value.size();
+            ends[i] = end;
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        end += readVarint(pos);
+        ends[i] = end;
+    }
+    std::memcpy(bytes, pos, end);
+    pos += end;
+}
+
+} // namespace codec
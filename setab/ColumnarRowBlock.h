@@ -0,0 +1,796 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#pragma once
+
+#include "setab/BlockCodec.h"
+#include "setab/Row.h"
+#include "setab/RowBuffer.h"
+#include "setab/TextDictionary.h"
+#include "setab/Util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
+
+#include <folly/SharedMutex.h>
+
+// Describes where each of a table's columns lives in a ColumnarRowBlockImpl.
+// INTEGER columns get a contiguous int64_t array each, TEXT columns get an
+// array of end offsets into a per-column byte arena. An interned TEXT column
+// gets an array of codes into its dictionary instead, and no arena.
+struct ColumnarLayout {
+    static constexpr size_t DefaultTextBytesPerRow = 64;
+
+    explicit ColumnarLayout(const vector<Column>& schema,
+                            size_t textBytesPerRow = DefaultTextBytesPerRow)
+        : textBytesPerRow{textBytesPerRow} {
+        for (const auto& col : schema) {
+            types.push_back(col.type);
+            if (col.type == ColumnType::INTEGER) {
+                slots.push_back(integerColumns++);
+            } else {
+                slots.push_back(textColumns++);
+            }
+        }
+        dictionaries.resize(textColumns);
+    }
+
+    // Stores a TEXT column's values in a dictionary shared by every block,
+    // rather than in each block's arena. Once the dictionary holds
+    // maxEntries values, rows with a new value are dropped.
+    void internColumn(size_t column, size_t maxEntries = TextDictionary::MaxEntries) {
+        if (types.at(column) != ColumnType::TEXT) {
+            throw std::invalid_argument("Only TEXT columns can be interned.");
+        }
+        dictionaries[slots[column]] = std::make_shared<TextDictionary>(maxEntries);
+    }
+
+    bool interned(size_t column) const {
+        return types[column] == ColumnType::TEXT && dictionaries[slots[column]] != nullptr;
+    }
+
+    // Has every sealed block keep an index of the column's values, for
+    // finding equal rows without looking at all of them.
+    void indexColumn(size_t column) {
+        types.at(column);
+        if (indexOf(column) < 0) {
+            indexedColumns.push_back(column);
+        }
+    }
+
+    // Where the column's index is among a block's indexes, or -1.
+    int indexOf(size_t column) const {
+        auto found = std::find(indexedColumns.begin(), indexedColumns.end(), column);
+        return found == indexedColumns.end() ? -1 : static_cast<int>(found - indexedColumns.begin());
+    }
+
+    vector<ColumnType> types;
+    // For each column, its index among the columns of the same type.
+    vector<size_t> slots;
+    size_t integerColumns{0};
+    size_t textColumns{0};
+    // How much arena to give each TEXT column per row when a block is built.
+    size_t textBytesPerRow;
+    // For each TEXT column, its dictionary if it's interned, or null.
+    vector<std::shared_ptr<TextDictionary>> dictionaries;
+    vector<size_t> indexedColumns;
+};
+
+// A block of rows stored column by column, as laid out by a ColumnarLayout.
+// It's a drop in replacement for RowBlockImpl, except that rows handed out
+// by at() are lightweight references into the block, rather than Rows.
+//
+// A TEXT arena is allocated once, when the block is built, and never moves
+// while the block has rows in it, so views handed out to readers stay valid.
+// When a row's text doesn't fit, the block reports itself full and the
+// buffer moves on to a new one.
+//
+// A sealed block can be copied into a SpillSegment by spillTo(). The copy
+// reads its columns out of the segment's mapping instead of the heap.
+//
+// A sealed block can also be compressed, with the encodings in BlockCodec.h.
+// A compressed block can't be read directly: cursors decompress() it into
+// a plain copy while they're on it.
+//
+// Indexed columns get a sorted list of distinct keys per block, each with
+// the offsets of the rows that have it, built when the block is sealed.
+// The storage for it is allocated with the block, like everything else.
+// Sealing also records each INTEGER column's min and max, so that readers
+// can tell a block has nothing for them without reading it. Spilled and
+// compressed copies keep those in memory.
+template<size_t BlockSz, class LockT = folly::SharedMutex>
+class ColumnarRowBlockImpl : public RowBlockBase<ColumnarRowBlockImpl<BlockSz, LockT>, LockT> {
+public:
+    using Lock = LockT;
+    using Options = std::shared_ptr<const ColumnarLayout>;
+
+    static constexpr size_t BlockSize = BlockSz;
+
+    class RowRef {
+    public:
+        RowRef(const ColumnarRowBlockImpl<BlockSz, Lock>* block, size_t offset, bool valid)
+            : block_{block}, offset_{offset}, valid_{valid} {}
+
+        int64_t rowId() const { return valid_ ? block_->rowIds_[offset_] : -1; }
+
+        milliseconds ts() const { return valid_ ? milliseconds(block_->integers(0)[offset_]) : 0ms; }
+
+        bool valid() const { return valid_; }
+
+        size_t columnCount() const { return valid_ ? block_->layout_->types.size() : 0; }
+
+        ColumnView column(size_t i) const { return block_->value(i, offset_); }
+
+        // Whether column i's text is in a dictionary, which outlives the block.
+        bool interned(size_t i) const { return block_->layout_->interned(i); }
+
+        friend std::ostream& operator<<(std::ostream& o, const RowRef& r) {
+            o << "Row:ts=" << r.ts().count()
+              << ":size=" << r.columnCount();
+            for (size_t i=0; i < r.columnCount(); i++) {
+                o << ":col[" << i << "]=";
+                auto col = r.column(i);
+                if (std::get<0>(col) == ColumnType::INTEGER) {
+                    o << std::get<2>(col);
+                } else {
+                    o << "'" << std::get<1>(col) << "'";
+                }
+            }
+            return o;
+        }
+
+    private:
+        const ColumnarRowBlockImpl<BlockSz, Lock>* block_;
+        size_t offset_;
+        bool valid_;
+    };
+
+    static std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>> create(const Options& layout) {
+        return std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>>(new ColumnarRowBlockImpl<BlockSz, Lock>(layout));
+    }
+
+    explicit ColumnarRowBlockImpl(Options layout)
+        : layout_{move(layout)},
+          segment_{},
+          stride_{BlockSz},
+          ownedIntegers_{new int64_t[BlockSz * (1 + layout_->integerColumns)]},
+          rowIds_{ownedIntegers_.get()},
+          integerData_{ownedIntegers_.get() + BlockSz},
+          textColumns_(layout_->textColumns),
+          compressed_{nullptr},
+          compressedSize_{0},
+          ownedCompressed_{},
+          indexes_(layout_->indexedColumns.size()),
+          indexed_{false},
+          zones_{new int64_t[2 * layout_->integerColumns]},
+          zoned_{false} {
+        setDictionaries();
+        for (auto& index : indexes_) {
+            index.ownedKeys.reset(new uint64_t[BlockSz]);
+            index.ownedStarts.reset(new uint32_t[BlockSz + 1]);
+            index.ownedOffsets.reset(new uint32_t[BlockSz]);
+            index.keys = index.ownedKeys.get();
+            index.starts = index.ownedStarts.get();
+            index.offsets = index.ownedOffsets.get();
+        }
+        for (auto& textCol : textColumns_) {
+            textCol.ownedEnds.reset(new uint32_t[BlockSz]);
+            textCol.ends = textCol.ownedEnds.get();
+            textCol.capacity = arenaBytes(textCol);
+            if (textCol.capacity > 0) {
+                textCol.ownedBytes.reset(new char[textCol.capacity]);
+                textCol.bytes = textCol.ownedBytes.get();
+            }
+        }
+        this->resetBase(footprint());
+    }
+
+    ColumnarRowBlockImpl(const ColumnarRowBlockImpl<BlockSz, Lock>&) = delete;
+    ColumnarRowBlockImpl<BlockSz, Lock>& operator=(const ColumnarRowBlockImpl<BlockSz, Lock>&) = delete;
+
+    // Whether the row's text can be stored at all: a full dictionary has no
+    // code for a value it hasn't seen. Only the writer may ask.
+    static bool storable(const Options& layout, const Row& row) {
+        for (size_t i=0; i < layout->types.size(); i++) {
+            if (layout->interned(i) &&
+                !layout->dictionaries[layout->slots[i]]->admits(std::get<1>(row.column(i)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Erases the rows of a batch that can't be stored, counting the new
+    // values that earlier rows in the batch will intern, and returns how many
+    // it erased. Only the writer may call this.
+    static size_t dropUnstorable(const Options& layout, vector<Row>& rows) {
+        bool crowded = false;
+        for (auto& dictionary : layout->dictionaries) {
+            if (dictionary && dictionary->size() + rows.size() > dictionary->capacity()) {
+                crowded = true;
+            }
+        }
+        if (!crowded) {
+            return 0;
+        }
+        // Copies, since rows move as they're erased.
+        vector<std::unordered_set<string>> pending(layout->textColumns);
+        auto kept = std::remove_if(rows.begin(), rows.end(), [&](const Row& row) {
+            for (size_t i=0; i < layout->types.size(); i++) {
+                if (!layout->interned(i)) {
+                    continue;
+                }
+                auto& dictionary = *layout->dictionaries[layout->slots[i]];
+                auto& added = pending[layout->slots[i]];
+                auto value = std::get<1>(row.column(i));
+                if (!dictionary.contains(value) && added.count(value.str()) == 0 &&
+                    dictionary.size() + added.size() >= dictionary.capacity()) {
+                    return true;
+                }
+            }
+            for (size_t i=0; i < layout->types.size(); i++) {
+                if (!layout->interned(i)) {
+                    continue;
+                }
+                auto value = std::get<1>(row.column(i));
+                if (!layout->dictionaries[layout->slots[i]]->contains(value)) {
+                    pending[layout->slots[i]].insert(value.str());
+                }
+            }
+            return false;
+        });
+        size_t dropped = rows.end() - kept;
+        rows.erase(kept, rows.end());
+        return dropped;
+    }
+
+    // Rows are copied into storage the block already has, so they cost
+    // nothing extra.
+    static size_t rowBytes(const Row&) {
+        return 0;
+    }
+
+    // Every byte a columnar block uses is allocated when it's built, or
+    // when an empty block grows an arena, so rows never add to this. A
+    // spilled block's columns are on disk, and don't count.
+    size_t footprint() const {
+        size_t sz = allocatedBytes(sizeof(*this))
+            + allocatedBytes(textColumns_.capacity() * sizeof(TextColumn))
+            + allocatedBytes(indexes_.capacity() * sizeof(ColumnIndex))
+            + allocatedBytes(2 * layout_->integerColumns * sizeof(int64_t));
+        if (spilled()) {
+            return sz;
+        }
+        if (compressed()) {
+            return sz + allocatedBytes(compressedSize_);
+        }
+        sz += allocatedBytes(BlockSz * (1 + layout_->integerColumns) * sizeof(int64_t));
+        for (const auto& textCol : textColumns_) {
+            sz += allocatedBytes(BlockSz * sizeof(uint32_t)) + allocatedBytes(textCol.capacity);
+        }
+        sz += indexes_.size() * (allocatedBytes(BlockSz * sizeof(uint64_t))
+                                 + allocatedBytes((BlockSz + 1) * sizeof(uint32_t))
+                                 + allocatedBytes(BlockSz * sizeof(uint32_t)));
+        return sz;
+    }
+
+    bool spilled() const { return segment_ != nullptr; }
+
+    bool compressed() const { return compressed_ != nullptr; }
+
+    // What spillTo() takes up in a segment.
+    size_t spillSize() const {
+        if (compressed()) {
+            return SpillSegment::alignedSize(compressedSize_);
+        }
+        size_t used = this->size();
+        size_t sz = SpillSegment::alignedSize(used * sizeof(int64_t)) * (1 + layout_->integerColumns);
+        for (const auto& textCol : textColumns_) {
+            sz += SpillSegment::alignedSize(used * sizeof(uint32_t)) + SpillSegment::alignedSize(textCol.used);
+        }
+        if (indexed_.load(std::memory_order_acquire)) {
+            for (const auto& index : indexes_) {
+                sz += SpillSegment::alignedSize(index.distinct * sizeof(uint64_t))
+                    + SpillSegment::alignedSize((index.distinct + 1) * sizeof(uint32_t))
+                    + SpillSegment::alignedSize(used * sizeof(uint32_t));
+            }
+        }
+        return sz;
+    }
+
+    // What this block takes up on disk, if it's been spilled.
+    size_t spilledBytes() const {
+        return spilled() ? spillSize() : 0;
+    }
+
+    // Copies a sealed block into `segment`, which must have spillSize()
+    // bytes left, and returns a block that reads from there instead. The
+    // copy has the same rows, times and sequence number, but no next block.
+    std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>>
+    spillTo(const std::shared_ptr<SpillSegment>& segment) const {
+        size_t used = this->size();
+        std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>> copy(
+            new ColumnarRowBlockImpl<BlockSz, Lock>(layout_, segment, used));
+        copy->copyZones(*this);
+        if (compressed()) {
+            copy->compressed_ = segment->append(compressed_, compressedSize_);
+            copy->compressedSize_ = compressedSize_;
+            copy->copyRowState(*this);
+            return copy;
+        }
+        copy->rowIds_ = reinterpret_cast<int64_t*>(segment->append(rowIds_, used * sizeof(int64_t)));
+        // Each column is a multiple of 8 bytes, so they land back to back.
+        for (size_t i=0; i < layout_->integerColumns; i++) {
+            auto column = segment->append(integerData_ + i * stride_, used * sizeof(int64_t));
+            if (i == 0) {
+                copy->integerData_ = reinterpret_cast<int64_t*>(column);
+            }
+        }
+        for (size_t i=0; i < textColumns_.size(); i++) {
+            const auto& textCol = textColumns_[i];
+            auto& copyCol = copy->textColumns_[i];
+            copyCol.ends = reinterpret_cast<uint32_t*>(segment->append(textCol.ends, used * sizeof(uint32_t)));
+            if (textCol.used > 0) {
+                copyCol.bytes = segment->append(textCol.bytes, textCol.used);
+            }
+            copyCol.capacity = textCol.used;
+            copyCol.used = textCol.used;
+        }
+        if (indexed_.load(std::memory_order_acquire)) {
+            for (size_t i=0; i < indexes_.size(); i++) {
+                const auto& index = indexes_[i];
+                auto& copyIndex = copy->indexes_[i];
+                copyIndex.keys = reinterpret_cast<const uint64_t*>(
+                    segment->append(index.keys, index.distinct * sizeof(uint64_t)));
+                copyIndex.starts = reinterpret_cast<const uint32_t*>(
+                    segment->append(index.starts, (index.distinct + 1) * sizeof(uint32_t)));
+                copyIndex.offsets = reinterpret_cast<const uint32_t*>(
+                    segment->append(index.offsets, used * sizeof(uint32_t)));
+                copyIndex.distinct = index.distinct;
+            }
+            copy->indexed_.store(true, std::memory_order_relaxed);
+        }
+        copy->copyRowState(*this);
+        return copy;
+    }
+
+    // Returns a compressed copy of a sealed block, or nullptr if it's already
+    // compressed or has been spilled. Like spillTo(), the copy has no next block.
+    std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>> compress() const {
+        if (spilled() || compressed()) {
+            return nullptr;
+        }
+        size_t used = this->size();
+        string out;
+        codec::appendDeltas(out, rowIds_, used);
+        for (size_t i=0; i < layout_->integerColumns; i++) {
+            codec::appendDeltas(out, integerData_ + i * stride_, used);
+        }
+        for (const auto& textCol : textColumns_) {
+            if (textCol.dictionary) {
+                codec::appendCodes(out, textCol.ends, used);
+            } else {
+                codec::appendText(out, textCol.ends, textCol.bytes, used);
+            }
+        }
+
+        std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>> copy(
+            new ColumnarRowBlockImpl<BlockSz, Lock>(layout_, nullptr, 0));
+        copy->ownedCompressed_.reset(new char[out.size()]);
+        std::memcpy(copy->ownedCompressed_.get(), out.data(), out.size());
+        copy->compressed_ = copy->ownedCompressed_.get();
+        copy->compressedSize_ = out.size();
+        copy->copyZones(*this);
+        copy->resetBase(copy->footprint());
+        copy->copyRowState(*this);
+        return copy;
+    }
+
+    // Returns a plain, readable copy of a compressed block, or nullptr if the
+    // block isn't compressed.
+    std::unique_ptr<ColumnarRowBlockImpl<BlockSz, Lock>> decompress() const {
+        if (!compressed()) {
+            return nullptr;
+        }
+        size_t used = this->size();
+        auto plain = create(layout_);
+        const char* pos = compressed_;
+        codec::readDeltas(pos, plain->rowIds_, used);
+        for (size_t i=0; i < layout_->integerColumns; i++) {
+            codec::readDeltas(pos, plain->integerData_ + i * BlockSz, used);
+        }
+        for (auto& textCol : plain->textColumns_) {
+            if (textCol.dictionary) {
+                codec::readCodes(pos, textCol.ends, used);
+                continue;
+            }
+            size_t total = codec::textBytes(pos);
+            if (total > textCol.capacity) {
+                textCol.capacity = total;
+                textCol.ownedBytes.reset(new char[textCol.capacity]);
+                textCol.bytes = textCol.ownedBytes.get();
+            }
+            codec::readText(pos, textCol.ends, textCol.bytes, used);
+            textCol.used = total;
+        }
+        plain->resetBase(plain->footprint());
+        plain->copyRowState(*this);
+        plain->seal();
+        return plain;
+    }
+
+    // Records the block's zone maps, and builds its indexes.
+    void seal() {
+        size_t used = this->size();
+        for (size_t i=0; i < layout_->integerColumns; i++) {
+            const int64_t* values = integerData_ + i * stride_;
+            int64_t low = std::numeric_limits<int64_t>::max();
+            int64_t high = std::numeric_limits<int64_t>::min();
+            for (size_t j=0; j < used; j++) {
+                low = std::min(low, values[j]);
+                high = std::max(high, values[j]);
+            }
+            zones_[2 * i] = low;
+            zones_[2 * i + 1] = high;
+        }
+        zoned_.store(true, std::memory_order_release);
+        if (indexes_.empty()) {
+            return;
+        }
+        vector<std::pair<uint64_t, uint32_t>> entries(used);
+        for (size_t n=0; n < indexes_.size(); n++) {
+            size_t column = layout_->indexedColumns[n];
+            auto& index = indexes_[n];
+            for (size_t i=0; i < used; i++) {
+                entries[i] = std::make_pair(indexKey(value(column, i)), static_cast<uint32_t>(i));
+            }
+            std::sort(entries.begin(), entries.end());
+            index.distinct = 0;
+            for (size_t i=0; i < used; i++) {
+                if (i == 0 || entries[i].first != entries[i-1].first) {
+                    index.ownedKeys[index.distinct] = entries[i].first;
+                    index.ownedStarts[index.distinct++] = i;
+                }
+                index.ownedOffsets[i] = entries[i].second;
+            }
+            index.ownedStarts[index.distinct] = used;
+        }
+        indexed_.store(true, std::memory_order_release);
+    }
+
+    // Whether some row's INTEGER column might be within [low, high]. Only
+    // sealed blocks know for sure; others always might.
+    bool mayContain(size_t column, int64_t low, int64_t high) const {
+        if (!zoned_.load(std::memory_order_acquire)) {
+            return true;
+        }
+        size_t slot = layout_->slots[column];
+        return zones_[2 * slot] <= high && zones_[2 * slot + 1] >= low;
+    }
+
+    // The smallest and largest value of an INTEGER column, once sealed.
+    std::pair<int64_t, int64_t> zone(size_t column) const {
+        size_t slot = layout_->slots[column];
+        return std::make_pair(zones_[2 * slot], zones_[2 * slot + 1]);
+    }
+
+    // The first row in [from, end) whose INTEGER column is within
+    // [low, high], or `end` if there isn't one.
+    size_t nextInRange(size_t column, int64_t low, int64_t high, size_t from, size_t end) const {
+        const int64_t* values = integers(column);
+        for (; from < end; from++) {
+            if (values[from] >= low && values[from] <= high) {
+                return from;
+            }
+        }
+        return end;
+    }
+
+    // The first row in [from, end) whose column equals `value`, or `end` if
+    // there isn't one. Indexed columns of sealed blocks are looked up in
+    // the index, anything else is scanned.
+    size_t nextMatch(size_t column, const ColumnView& value, size_t from, size_t end) const {
+        int n = layout_->indexOf(column);
+        if (n < 0 || !indexed_.load(std::memory_order_acquire)) {
+            for (; from < end; from++) {
+                if (matches(column, from, value)) {
+                    return from;
+                }
+            }
+            return end;
+        }
+        const auto& index = indexes_[n];
+        uint64_t key = indexKey(value);
+        const uint64_t* found = std::lower_bound(index.keys, index.keys + index.distinct, key);
+        if (found == index.keys + index.distinct || *found != key) {
+            return end;
+        }
+        // Rows with the same key are in order, but different text can
+        // share a key.
+        size_t k = found - index.keys;
+        const uint32_t* last = index.offsets + index.starts[k+1];
+        for (auto row = std::lower_bound(index.offsets + index.starts[k], last, from);
+             row != last && *row < end; ++row) {
+            if (matches(column, *row, value)) {
+                return *row;
+            }
+        }
+        return end;
+    }
+
+    // Copies the row into the block. The row is left untouched.
+    bool appendRow(Row& row) {
+        auto guard(this->lockExclusive());
+        if (!fits(row)) {
+            return false;
+        }
+        appendRowLocked(row);
+        return true;
+    }
+
+    // Appends as many rows from [begin, end) as will fit, under one lock.
+    // Returns the number of rows that were copied into the block.
+    template<class RowIter>
+    size_t appendRows(RowIter begin, RowIter end) {
+        auto guard(this->lockExclusive());
+        size_t appended = 0;
+        for (; begin != end && fits(*begin); ++begin) {
+            appendRowLocked(*begin);
+            appended++;
+        }
+        return appended;
+    }
+
+    // Empties the block for reuse. Arenas that grew for an oversized row
+    // go back to the usual size. Spilled blocks can't be reused.
+    void reset() {
+        for (auto& textCol : textColumns_) {
+            size_t capacity = arenaBytes(textCol);
+            if (textCol.capacity != capacity) {
+                textCol.capacity = capacity;
+                textCol.ownedBytes.reset(new char[textCol.capacity]);
+                textCol.bytes = textCol.ownedBytes.get();
+            }
+            textCol.used = 0;
+        }
+        indexed_.store(false, std::memory_order_relaxed);
+        zoned_.store(false, std::memory_order_relaxed);
+        this->resetBase(footprint());
+    }
+
+    // Rows of a compressed block always read as invalid; see decompress().
+    RowRef at(size_t offset) const {
+        return RowRef(this, offset, offset < this->size() && !compressed());
+    }
+
+    RowRef front() const {
+        return at(0);
+    }
+
+    RowRef back() const {
+        return at(this->offset());
+    }
+
+    // The values of an INTEGER column, one per row, contiguous in memory.
+    // Only the first size() entries are meaningful.
+    const int64_t* integers(size_t column) const {
+        return integerData_ + layout_->slots[column] * stride_;
+    }
+
+    folly::StringPiece text(size_t column, size_t offset) const {
+        const auto& textCol = textColumns_[layout_->slots[column]];
+        if (textCol.dictionary) {
+            return textCol.dictionary->lookup(textCol.ends[offset]);
+        }
+        uint32_t start = offset == 0 ? 0 : textCol.ends[offset-1];
+        return folly::StringPiece(textCol.bytes + start, textCol.ends[offset] - start);
+    }
+
+    const ColumnarLayout& layout() const { return *layout_; }
+
+    ColumnView value(size_t column, size_t offset) const {
+        if (layout_->types[column] == ColumnType::INTEGER) {
+            return ColumnView(ColumnType::INTEGER, folly::StringPiece(), integers(column)[offset]);
+        }
+        return ColumnView(ColumnType::TEXT, text(column, offset), -1);
+    }
+
+#if defined(SETAB_ROWBLOCK_DEBUG)
+    ~ColumnarRowBlockImpl() {
+        std::cout << "Destroying ColumnarRowBlock for ids="
+                  << front().rowId() << ":" << back().rowId()
+                  << " ts=" << this->minMaxTime().first.count() << ":" << this->minMaxTime().second.count() << "\n";
+    }
+#else
+    ~ColumnarRowBlockImpl() = default;
+#endif
+
+private:
+    // Where readers find a TEXT column, which is either the storage the
+    // column owns or a spill segment. An interned column keeps its codes
+    // in `ends`, and has no bytes.
+    struct TextColumn {
+        TextDictionary* dictionary{nullptr};
+        uint32_t* ends{nullptr};
+        char* bytes{nullptr};
+        size_t capacity{0};
+        size_t used{0};
+        std::unique_ptr<uint32_t[]> ownedEnds;
+        std::unique_ptr<char[]> ownedBytes;
+    };
+
+    // Distinct keys in order, and where each one's rows start in `offsets`.
+    // The last start is the row count.
+    struct ColumnIndex {
+        const uint64_t* keys{nullptr};
+        const uint32_t* starts{nullptr};
+        const uint32_t* offsets{nullptr};
+        size_t distinct{0};
+        std::unique_ptr<uint64_t[]> ownedKeys;
+        std::unique_ptr<uint32_t[]> ownedStarts;
+        std::unique_ptr<uint32_t[]> ownedOffsets;
+    };
+
+    // INTEGER values are their own keys; text is hashed.
+    static uint64_t indexKey(const ColumnView& value) {
+        if (std::get<0>(value) == ColumnType::INTEGER) {
+            return static_cast<uint64_t>(std::get<2>(value));
+        }
+        return codec::TextHash()(std::get<1>(value));
+    }
+
+    bool matches(size_t column, size_t offset, const ColumnView& value) const {
+        if (layout_->types[column] == ColumnType::INTEGER) {
+            return integers(column)[offset] == std::get<2>(value);
+        }
+        return text(column, offset) == std::get<1>(value);
+    }
+
+    // A block without storage of its own, for spillTo() and compress() to
+    // point at a segment or compressed data.
+    ColumnarRowBlockImpl(Options layout, std::shared_ptr<SpillSegment> segment, size_t stride)
+        : layout_{move(layout)},
+          segment_{move(segment)},
+          stride_{stride},
+          ownedIntegers_{},
+          rowIds_{nullptr},
+          integerData_{nullptr},
+          textColumns_(layout_->textColumns),
+          compressed_{nullptr},
+          compressedSize_{0},
+          ownedCompressed_{},
+          indexes_(layout_->indexedColumns.size()),
+          indexed_{false},
+          zones_{new int64_t[2 * layout_->integerColumns]},
+          zoned_{false} {
+        setDictionaries();
+        this->resetBase(footprint());
+    }
+
+    void copyZones(const ColumnarRowBlockImpl<BlockSz, Lock>& other) {
+        if (other.zoned_.load(std::memory_order_acquire)) {
+            std::copy(other.zones_.get(), other.zones_.get() + 2 * layout_->integerColumns, zones_.get());
+            zoned_.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void setDictionaries() {
+        for (size_t i=0; i < textColumns_.size(); i++) {
+            textColumns_[i].dictionary = layout_->dictionaries[i].get();
+        }
+    }
+
+    size_t arenaBytes(const TextColumn& textCol) const {
+        return textCol.dictionary ? 0 : BlockSz * layout_->textBytesPerRow;
+    }
+
+    // Must be called with the lock held.
+    bool fits(const Row& row) {
+        size_t used = this->size();
+        if (used == BlockSz) {
+            return false;
+        }
+        if (row.columnCount() != layout_->types.size()) {
+            throw std::invalid_argument("Row does not match the block's column layout.");
+        }
+        for (size_t i=0; i < layout_->types.size(); i++) {
+            if (layout_->types[i] != ColumnType::TEXT) {
+                continue;
+            }
+            auto& textCol = textColumns_[layout_->slots[i]];
+            if (textCol.dictionary) {
+                if (!textCol.dictionary->admits(std::get<1>(row.column(i)))) {
+                    return false;
+                }
+                continue;
+            }
+            size_t len = std::get<1>(row.column(i)).size();
+            if (textCol.used + len <= textCol.capacity) {
+                continue;
+            }
+            if (used > 0) {
+                return false;
+            }
+            // Nobody can be looking at an empty block's text, so it's safe to
+            // make room for a row that's larger than the usual arena.
+            textCol.capacity = len;
+            textCol.ownedBytes.reset(new char[textCol.capacity]);
+            textCol.bytes = textCol.ownedBytes.get();
+            this->blockSize.store(footprint(), std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    void appendRowLocked(const Row& row) {
+        size_t used = this->size();
+        rowIds_[used] = row.rowId();
+        for (size_t i=0; i < layout_->types.size(); i++) {
+            auto col = row.column(i);
+            if (layout_->types[i] == ColumnType::INTEGER) {
+                integerData_[layout_->slots[i] * BlockSz + used] = std::get<2>(col);
+            } else {
+                auto& textCol = textColumns_[layout_->slots[i]];
+                auto value = std::get<1>(col);
+                if (textCol.dictionary) {
+                    textCol.ends[used] = textCol.dictionary->intern(value);
+                    continue;
+                }
+                std::memcpy(textCol.bytes + textCol.used, value.data(), value.size());
+                textCol.used += value.size();
+                textCol.ends[used] = textCol.used;
+            }
+        }
+        this->publishRow(row.ts(), 0);
+    }
+
+    const Options layout_;
+    // Set once the block has been spilled.
+    const std::shared_ptr<SpillSegment> segment_;
+    // The distance between INTEGER columns: BlockSz, or the row count once
+    // spilled, since a spilled block is packed.
+    const size_t stride_;
+    // The rowIds and then each INTEGER column, for a block in memory.
+    std::unique_ptr<int64_t[]> ownedIntegers_;
+    int64_t* rowIds_;
+    int64_t* integerData_;
+    vector<TextColumn> textColumns_;
+    // Set for a compressed block, in place of the columns above. The data
+    // is either owned or in the block's segment.
+    const char* compressed_;
+    size_t compressedSize_;
+    std::unique_ptr<char[]> ownedCompressed_;
+    // One per indexed column. Readers may use them once indexed_ is set.
+    vector<ColumnIndex> indexes_;
+    std::atomic<bool> indexed_;
+    // Each INTEGER column's min then max. Readers may use them once zoned_
+    // is set.
+    std::unique_ptr<int64_t[]> zones_;
+    std::atomic<bool> zoned_;
+};
+
+// The RowBuffer types used for Setab tables. Each table has exactly one
+// writer, its ingest thread, so its blocks don't need to lock.
+using ColumnarRowBlock = ColumnarRowBlockImpl<1000, SingleWriterLock>;
+using ColumnarRowCursor = RowCursorImpl<ColumnarRowBlock>;
+using ColumnarRowBuffer = RowBufferImpl<ColumnarRowBlock, ColumnarRowCursor>;
@@ -26,6 +26,14 @@
 
 #include <folly/Synchronized.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <zmq.h>
+
 class Setab;
 
 /*
@@ -35,27 +43,120 @@ class Setab;
  * See the note in `Window.h` for details on that operator.
  */
 class SetabRegistry {
-    folly::Synchronized<unordered_map<string, Setab*>> liveTables_;
+    // Every connection to a table shares the one Setab, which goes away
+    // with the last of them.
+    folly::Synchronized<unordered_map<string, std::weak_ptr<Setab>>> liveTables_;
+
+    // Bumped whenever any table takes in rows, so that something waiting
+    // on a bunch of tables can wait on all of them at once.
+    std::atomic<size_t> ingestSeq_{0};
+    std::mutex ingestLock_;
+    std::condition_variable ingestCondition_;
+
+    // The zmq context tables made with shared_context=1 use.
+    std::mutex contextLock_;
+    void* zctx_{nullptr};
+    int ioThreads_{1};
 public:
+    SetabRegistry() = default;
+    SetabRegistry(const SetabRegistry&) = delete;
+    SetabRegistry& operator=(const SetabRegistry&) = delete;
+
+    // Waits for every socket on the shared context to close, so the tables
+    // using it have to go first.
+    ~SetabRegistry() {
+        if (zctx_ != nullptr) {
+            zmq_ctx_term(zctx_);
+        }
+    }
 
-    void addTable(string tableName, Setab* vtab) {
-        liveTables_->insert({tableName, vtab});
+    // Made the first time a table asks for it.
+    void* zmqContext() {
+        std::lock_guard<std::mutex> guard(contextLock_);
+        if (zctx_ == nullptr) {
+            if ((zctx_ = zmq_ctx_new()) == nullptr) {
+                throw std::runtime_error(zmq_strerror(zmq_errno()));
+            }
+            zmq_ctx_set(zctx_, ZMQ_IO_THREADS, ioThreads_);
+        }
+        return zctx_;
+    }
+
+    // The size of the shared context's I/O thread pool. Only counts before
+    // the first table asks for the context.
+    void setZmqIoThreads(int threads) {
+        std::lock_guard<std::mutex> guard(contextLock_);
+        ioThreads_ = threads;
     }
 
-    Setab* getTable(const string& tableName) {
-        return liveTables_->operator[](tableName);
+    void addTable(string tableName, std::weak_ptr<Setab> vtab) {
+        liveTables_->operator[](tableName) = vtab;
+    }
+
+    // Null if the table isn't live.
+    std::shared_ptr<Setab> getTable(const string& tableName) {
+        std::shared_ptr<Setab> table;
+        SYNCHRONIZED(liveTables_) {
+            auto it = liveTables_.find(tableName);
+            if (it != liveTables_.end()) {
+                table = it->second.lock();
+            }
+        }
+        return table;
     }
 
+    // Every table that's live right now.
+    vector<std::shared_ptr<Setab>> liveTables() {
+        vector<std::shared_ptr<Setab>> tables;
+        SYNCHRONIZED(liveTables_) {
+            for (const auto& entry : liveTables_) {
+                if (auto table = entry.second.lock()) {
+                    tables.push_back(move(table));
+                }
+            }
+        }
+        return tables;
+    }
+
+    // A table removes itself as it dies, so only drop the entry if a new
+    // table of the same name hasn't taken its place already.
     void removeTable(const string& tableName) {
-        liveTables_->erase(tableName);
+        SYNCHRONIZED(liveTables_) {
+            auto it = liveTables_.find(tableName);
+            if (it != liveTables_.end() && it->second.expired()) {
+                liveTables_.erase(it);
+            }
+        }
     }
 
     void renameTable(const string& oldName, string newName) {
         SYNCHRONIZED(liveTables_) {
-            Setab* table = liveTables_[oldName];
+            std::weak_ptr<Setab> table = liveTables_[oldName];
             liveTables_[newName] = table;
             liveTables_.erase(oldName);
         }
     }
 
+    // Like the row buffer's writeSequence(): take this before checking the
+    // tables, then hand it to waitForIngest() to not miss rows in between.
+    size_t ingestSequence() const {
+        return ingestSeq_.load();
+    }
+
+    void notifyIngest() {
+        {
+            std::unique_lock<std::mutex> guard(ingestLock_);
+            ingestSeq_++;
+        }
+        ingestCondition_.notify_all();
+    }
+
+    // Returns false if nothing came in within maxWait.
+    bool waitForIngest(size_t seq, milliseconds maxWait) {
+        std::unique_lock<std::mutex> guard(ingestLock_);
+        return ingestCondition_.wait_for(guard, maxWait, [seq, this]() {
+            return ingestSeq_.load() != seq;
+        });
+    }
+
 };
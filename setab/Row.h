@@ -31,8 +31,13 @@ enum class ColumnType {
     TEXT = SQLITE_TEXT,
 };
 
+// An owned column value, used when building rows from scratch.
 using ColumnValue = std::tuple<ColumnType, string, int64_t>;
 
+// A column as stored in a Row. TEXT is a view into storage the Row shares
+// ownership of, so it stays valid for as long as any copy of the Row lives.
+using ColumnView = std::tuple<ColumnType, folly::StringPiece, int64_t>;
+
 struct Column {
     string name;
     ColumnType type;
@@ -44,31 +49,96 @@ struct Column {
  * And \036 is the byte for 'record separator'.
  * Where %ld is a 64bit signed integer in utf-8 base-10.
  * And %s is arbitrary bytes other than \036.
+ * Tables created with wire_format=binary use the encoding in WireFormat.h instead.
+ *
+ * Rows parsed off the wire keep the received message alive and point their
+ * TEXT columns straight into it, rather than copying each one out.
  */
 class Row {
     int64_t rowId_;
     size_t cachedSize_;
-    vector<ColumnValue> columns_;
+    std::shared_ptr<const void> storage_;
+    vector<ColumnView> columns_;
 
-    static size_t computeSize(const vector<ColumnValue>& cols) {
-        size_t sz = sizeof(rowId_) + sizeof(cachedSize_) + sizeof(columns_);
+    // The Row itself, plus what the allocator handed out for its columns
+    // and `storageBytes` for whatever its TEXT lives in.
+    static size_t computeSize(const vector<ColumnView>& cols, size_t storageBytes) {
+        return sizeof(Row) + allocatedBytes(cols.capacity() * sizeof(ColumnView)) + storageBytes;
+    }
+
+    // Storage that belongs to someone else, such as a received message, is
+    // shared and sized by its owner. The TEXT it holds for this row is the
+    // least it can cost.
+    static size_t externalBytes(const vector<ColumnView>& cols) {
+        size_t sz = 0;
         for (const auto& col : cols) {
-            sz += sizeof(ColumnValue);
             if (std::get<0>(col) == ColumnType::TEXT) {
                 sz += std::get<1>(col).size();
             }
         }
         return sz;
     }
+
+    // Copies all the TEXT of `columns` into one shared buffer and returns
+    // views over it. `storageBytes` is set to what that buffer costs.
+    static vector<ColumnView> ownColumns(const vector<ColumnValue>& columns,
+                                         std::shared_ptr<const void>& storage,
+                                         size_t& storageBytes) {
+        size_t textBytes = 0;
+        for (const auto& col : columns) {
+            textBytes += std::get<1>(col).size();
+        }
+        vector<ColumnView> views;
+        views.reserve(columns.size());
+        if (textBytes == 0) {
+            for (const auto& col : columns) {
+                views.emplace_back(std::get<0>(col), folly::StringPiece(), std::get<2>(col));
+            }
+            return views;
+        }
+
+        auto text = std::make_shared<string>();
+        text->reserve(textBytes);
+        for (const auto& col : columns) {
+            text->append(std::get<1>(col));
+        }
+        const char* pos = text->data();
+        for (const auto& col : columns) {
+            size_t len = std::get<1>(col).size();
+            views.emplace_back(std::get<0>(col), folly::StringPiece(pos, len), std::get<2>(col));
+            pos += len;
+        }
+        // make_shared puts the string in the same allocation as the two
+        // reference counts; the characters only need another one when they
+        // don't fit in the string itself.
+        storageBytes = allocatedBytes(2 * sizeof(long) + sizeof(void*) + sizeof(string));
+        const char* inlineText = reinterpret_cast<const char*>(text.get());
+        if (text->data() < inlineText || text->data() >= inlineText + sizeof(string)) {
+            storageBytes += allocatedBytes(text->capacity() + 1);
+        }
+        storage = move(text);
+        return views;
+    }
 public:
 
-    Row() : rowId_{-1}, cachedSize_{computeSize({})}, columns_{} {}
+    Row() : rowId_{-1}, cachedSize_{computeSize({}, 0)}, storage_{}, columns_{} {}
 
     explicit Row(int64_t rowId)
-        : rowId_{rowId}, cachedSize_{computeSize({})}, columns_{} {}
+        : rowId_{rowId}, cachedSize_{computeSize({}, 0)}, storage_{}, columns_{} {}
 
-    explicit Row(int64_t rowId, vector<ColumnValue> columns)
-        : rowId_{rowId}, cachedSize_{computeSize(columns)}, columns_{columns.begin(), columns.end()} {
+    explicit Row(int64_t rowId, const vector<ColumnValue>& columns)
+        : rowId_{rowId}, cachedSize_{0}, storage_{}, columns_{} {
+        size_t storageBytes = 0;
+        columns_ = ownColumns(columns, storage_, storageBytes);
+        cachedSize_ = computeSize(columns_, storageBytes);
+    }
+
+    // Builds a row whose TEXT columns point into `storage`.
+    explicit Row(int64_t rowId, std::shared_ptr<const void> storage, vector<ColumnView> columns)
+        : rowId_{rowId},
+          cachedSize_{computeSize(columns, externalBytes(columns))},
+          storage_{move(storage)},
+          columns_{move(columns)} {
     }
 
     int64_t rowId() const { return rowId_; }
@@ -77,7 +147,11 @@ public:
         return milliseconds(std::get<2>(columns_[0]));
     }
 
-    const vector<ColumnValue>& columns() const { return columns_; }
+    const vector<ColumnView>& columns() const { return columns_; }
+
+    size_t columnCount() const { return columns_.size(); }
+
+    ColumnView column(size_t i) const { return columns_[i]; }
 
     bool valid() const {
         return !columns_.empty();
@@ -87,6 +161,7 @@ public:
 
     void setConsumed() {}
 
+    // Roughly how much memory the row holds, including sizeof(Row).
     size_t size() const {
         return cachedSize_;
     }
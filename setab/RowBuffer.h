@@ -24,89 +24,128 @@
 #pragma once
 
 #include "setab/Row.h"
+#include "setab/SpillSegment.h"
 #include "setab/Util.h"
 
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
 #include <shared_mutex>
+#include <thread>
 
 #include <folly/SharedMutex.h>
 
 template <class RBT> class RowCursorImpl;
 
-// A block of rows. The rows are stored in order that they arrived in the
-// stream, but the block does track the min and max times in the block so that
-// we can efficiently filter through blocks. A row block also maintains a pointer
-// to the next block in the chain.
-template<size_t BlockSz, class LockT = folly::SharedMutex>
-class RowBlockImpl : public std::enable_shared_from_this<RowBlockImpl<BlockSz, LockT>> {
+// A lock for blocks that only ever have one writer. Blocks publish rows to
+// readers through an acquire/release pair on blockUsed, so with this as
+// LockT neither the writer nor the readers ever take a lock.
+struct SingleWriterLock {
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+    void lock_shared() {}
+    void unlock_shared() {}
+    bool try_lock_shared() { return true; }
+};
+
+// The bookkeeping every kind of block shares: the time range and size of
+// the rows in it, and the link to the next block.
+//
+// Rows are written first and then published by release-storing blockUsed.
+// Readers acquire-load it, so anything below blockUsed is safe to read
+// without holding the lock. Likewise a block is sealed, and its blockUsed
+// final, once its next block has been published.
+template<class BlockT, class LockT>
+class RowBlockBase {
 public:
     using Lock = LockT;
     using SharedHolder = std::shared_lock<Lock>;
     using ExclusiveHolder = std::unique_lock<Lock>;
 
-    static constexpr size_t BlockSize = BlockSz;
-
-    static std::shared_ptr<RowBlockImpl<BlockSz, Lock>> create() {
-        return std::make_shared<RowBlockImpl<BlockSz, Lock>>();
+    // Blocks don't own each other, the buffer owns them all.
+    BlockT* next() const {
+        return nextBlock.load(std::memory_order_acquire);
     }
 
-    bool appendRow(Row& row) {
+    void setNextBlock(BlockT* next) {
         auto guard(lockExclusive());
-        if (blockUsed == rows.max_size()) {
-            return false;
-        }
-        if (blockUsed>0) {
-            minTime = std::min(minTime, row.ts());
-            maxTime = std::max(maxTime, row.ts());
-        } else {
-            minTime = maxTime = row.ts();
-        }
-        rows[blockUsed] = move(row);
-        blockUsed++;
-        blockSize += row.size();
-        return true;
+        nextBlock.store(next, std::memory_order_release);
     }
 
-    std::shared_ptr<RowBlockImpl<BlockSz, Lock>> next() const {
-        auto guard(lockShared());
-        return nextBlock;
+    // True once the writer has moved on to another block.
+    bool sealed() const {
+        return next() != nullptr;
     }
 
-    void setNextBlock(std::shared_ptr<RowBlockImpl<BlockSz, Lock>> next) {
-        auto guard(lockExclusive());
-        nextBlock = next;
+    // Blocks are numbered in the order they join a buffer, which is what
+    // cursors pin to keep them from being freed.
+    uint64_t sequence() const {
+        return blockSequence;
+    }
+
+    void setSequence(uint64_t seq) {
+        blockSequence = seq;
     }
 
     size_t size() const {
-        auto guard(lockShared());
-        return blockUsed;
+        return blockUsed.load(std::memory_order_acquire);
     }
 
+    // The memory the block holds: its own storage, allocated up front, plus
+    // anything its rows allocated on top of that.
     size_t byteSize() const {
-        auto guard(lockShared());
-        return blockSize;
+        return blockSize.load(std::memory_order_relaxed);
     }
 
     std::pair<milliseconds, milliseconds> minMaxTime() const {
-        auto guard(lockShared());
-        return {minTime, maxTime};
+        return {minTime.load(std::memory_order_relaxed), maxTime.load(std::memory_order_relaxed)};
     }
 
-    const Row& at(size_t offset) const {
-        auto guard(lockShared());
-        return rows[offset];
+    // True if the rows' timestamps never go backwards, within this block.
+    bool ordered() const {
+        return blockOrdered.load(std::memory_order_relaxed);
     }
 
-    const Row& front() const {
-        auto guard(lockShared());
-        return rows.front();
+    // The offset of the first row at or after `from` with ts >= minTime, or
+    // size() if there isn't one yet. Binary searches when the rows are in
+    // order, which they nearly always are.
+    size_t lowerBound(milliseconds minTime, size_t from = 0) const {
+        auto self = static_cast<const BlockT*>(this);
+        size_t end = size();
+        if (!ordered()) {
+            while (from < end && self->at(from).ts() < minTime) {
+                from++;
+            }
+            return from;
+        }
+        while (from < end) {
+            size_t mid = from + (end - from) / 2;
+            if (self->at(mid).ts() < minTime) {
+                from = mid + 1;
+            } else {
+                end = mid;
+            }
+        }
+        return from;
     }
 
-    const Row& back() const {
-        auto guard(lockShared());
-        return rows[offset()];
-    }
+    // Blocks that can move to disk, or be compressed, hide these. By
+    // default they can't.
+    bool spilled() const { return false; }
+    size_t spillSize() const { return 0; }
+    size_t spilledBytes() const { return 0; }
+    std::unique_ptr<BlockT> spillTo(const std::shared_ptr<SpillSegment>&) const { return nullptr; }
+    bool compressed() const { return false; }
+    std::unique_ptr<BlockT> compress() const { return nullptr; }
+    std::unique_ptr<BlockT> decompress() const { return nullptr; }
+    // Called by the writer just before it seals the block, for blocks that
+    // build something over their final rows.
+    void seal() {}
 
     std::shared_lock<Lock> lockShared() const {
         return move(std::shared_lock<Lock>(blockLock));
@@ -116,36 +155,261 @@ public:
         return move(std::unique_lock<Lock>(blockLock));
     }
 
+protected:
+    // Forgets every row, so that the block can be reused. Nobody else may
+    // be looking at the block. `baseBytes` is what the empty block occupies.
+    void resetBase(size_t baseBytes) {
+        minTime.store(0ms, std::memory_order_relaxed);
+        maxTime.store(0ms, std::memory_order_relaxed);
+        blockSize.store(baseBytes, std::memory_order_relaxed);
+        blockUsed.store(0, std::memory_order_relaxed);
+        blockOrdered.store(true, std::memory_order_relaxed);
+        blockSequence = 0;
+        nextBlock.store(nullptr, std::memory_order_relaxed);
+    }
+
+    // Takes on the rows, times and sequence number of a sealed block that
+    // this block is a copy of.
+    void copyRowState(const RowBlockBase<BlockT, LockT>& other) {
+        minTime.store(other.minTime.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        maxTime.store(other.maxTime.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        blockOrdered.store(other.ordered(), std::memory_order_relaxed);
+        blockSequence = other.blockSequence;
+        blockUsed.store(other.size(), std::memory_order_relaxed);
+    }
+
+    size_t offset() const {
+        size_t used = size();
+        return used == 0 ? 0 : used-1;
+    }
+
+    // Makes the row just written at offset size() visible to readers.
+    void publishRow(milliseconds ts, size_t bytes) {
+        size_t used = blockUsed.load(std::memory_order_relaxed);
+        if (used > 0) {
+            if (ts < maxTime.load(std::memory_order_relaxed)) {
+                blockOrdered.store(false, std::memory_order_relaxed);
+            }
+            minTime.store(std::min(minTime.load(std::memory_order_relaxed), ts), std::memory_order_relaxed);
+            maxTime.store(std::max(maxTime.load(std::memory_order_relaxed), ts), std::memory_order_relaxed);
+        } else {
+            minTime.store(ts, std::memory_order_relaxed);
+            maxTime.store(ts, std::memory_order_relaxed);
+        }
+        blockSize.store(blockSize.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+        blockUsed.store(used + 1, std::memory_order_release);
+    }
+
+    mutable Lock blockLock{};
+    std::atomic<milliseconds> minTime{0ms};
+    std::atomic<milliseconds> maxTime{0ms};
+    std::atomic<size_t> blockSize{0};
+    std::atomic<size_t> blockUsed{0};
+    std::atomic<bool> blockOrdered{true};
+    uint64_t blockSequence{0};
+    std::atomic<BlockT*> nextBlock{nullptr};
+};
+
+// A block of rows. The rows are stored in order that they arrived in the
+// stream, but the block does track the min and max times in the block so that
+// we can efficiently filter through blocks. A row block also maintains a pointer
+// to the next block in the chain.
+template<size_t BlockSz, class LockT = folly::SharedMutex>
+class RowBlockImpl : public RowBlockBase<RowBlockImpl<BlockSz, LockT>, LockT> {
+    using Base = RowBlockBase<RowBlockImpl<BlockSz, LockT>, LockT>;
+public:
+    using Lock = LockT;
+    using RowRef = const Row&;
+
+    // Row blocks don't need anything from the table to be built.
+    struct Options {};
+
+    static constexpr size_t BlockSize = BlockSz;
+
+    static std::unique_ptr<RowBlockImpl<BlockSz, Lock>> create(const Options& = Options{}) {
+        return std::unique_ptr<RowBlockImpl<BlockSz, Lock>>(new RowBlockImpl<BlockSz, Lock>());
+    }
+
+    RowBlockImpl() {
+        this->resetBase(footprint());
+    }
+
+    // An empty block, which includes a Row slot for every row.
+    static size_t footprint() {
+        return allocatedBytes(sizeof(RowBlockImpl<BlockSz, Lock>));
+    }
+
+    // What a row adds to the block: whatever it allocated beyond its slot.
+    static size_t rowBytes(const Row& row) {
+        return row.size() - sizeof(Row);
+    }
+
+    // Any row can be stored.
+    static bool storable(const Options&, const Row&) {
+        return true;
+    }
+
+    static size_t dropUnstorable(const Options&, vector<Row>&) {
+        return 0;
+    }
+
+    bool appendRow(Row& row) {
+        auto guard(this->lockExclusive());
+        if (this->size() == BlockSz) {
+            return false;
+        }
+        appendRowLocked(row);
+        return true;
+    }
+
+    // Appends as many rows from [begin, end) as will fit, under one lock.
+    // Returns the number of rows that were moved into the block.
+    template<class RowIter>
+    size_t appendRows(RowIter begin, RowIter end) {
+        auto guard(this->lockExclusive());
+        size_t appended = 0;
+        for (; begin != end && this->size() < BlockSz; ++begin) {
+            appendRowLocked(*begin);
+            appended++;
+        }
+        return appended;
+    }
+
+    // Empties the block for reuse, releasing any storage the rows held.
+    void reset() {
+        for (size_t i=0; i < this->size(); i++) {
+            rows[i] = Row();
+        }
+        this->resetBase(footprint());
+    }
+
+    // Rows past the end of the block read as an empty, invalid row, rather
+    // than whatever the writer is in the middle of putting there.
+    const Row& at(size_t offset) const {
+        static const Row emptyRow;
+        return offset < this->size() ? rows[offset] : emptyRow;
+    }
+
+    const Row& front() const {
+        return at(0);
+    }
+
+    const Row& back() const {
+        return at(this->offset());
+    }
+
 #if defined(SETAB_ROWBLOCK_DEBUG)
     ~RowBlockImpl() {
         std::cout << "Destroying RowBlock for ids="
-                  << rows.front().rowId() << ":" << rows[offset()].rowId()
-                  << " ts=" << minTime.count() << ":" << maxTime.count() << "\n";
+                  << rows.front().rowId() << ":" << rows[this->offset()].rowId()
+                  << " ts=" << this->minMaxTime().first.count() << ":" << this->minMaxTime().second.count() << "\n";
     }
 #else
     ~RowBlockImpl() = default;
 #endif
 
 private:
-    size_t offset() const {
-        return blockUsed == 0 ? 0 : blockUsed-1;
+    void appendRowLocked(Row& row) {
+        size_t bytes = rowBytes(row);
+        milliseconds ts = row.ts();
+        rows[this->blockUsed.load(std::memory_order_relaxed)] = move(row);
+        this->publishRow(ts, bytes);
     }
-    mutable Lock blockLock{};
-    milliseconds minTime{0};
-    milliseconds maxTime{0};
-    size_t blockSize{0};
-    size_t blockUsed{0};
+
     std::array<Row, BlockSz> rows{};
-    std::shared_ptr<RowBlockImpl<BlockSz, Lock>> nextBlock;
+};
+
+// Epoch based reclamation for blocks. Every live cursor holds a Pin with
+// the sequence number of the oldest block it may still touch. The buffer
+// retires blocks it no longer wants onto a list, and only frees the ones
+// older than every pin. Moving a pin forward is a single atomic store, so
+// cursors pay nothing extra on the read path.
+class BlockPins {
+public:
+    static constexpr uint64_t Unpinned = std::numeric_limits<uint64_t>::max();
 
-    friend class RowCursorImpl<RowBlockImpl<BlockSz, Lock>>;
+    class Pin {
+    public:
+        Pin() : pins_{nullptr}, slot_{nullptr} {}
+
+        Pin(BlockPins* pins, uint64_t seq) : pins_{pins}, slot_{pins->acquire(seq)} {}
+
+        Pin(const Pin& other)
+            : pins_{other.pins_}, slot_{other.pins_ ? other.pins_->acquire(other.get()) : nullptr} {}
+
+        Pin(Pin&& other) noexcept : pins_{other.pins_}, slot_{other.slot_} {
+            other.pins_ = nullptr;
+            other.slot_ = nullptr;
+        }
+
+        Pin& operator=(Pin other) noexcept {
+            swap(pins_, other.pins_);
+            swap(slot_, other.slot_);
+            return *this;
+        }
+
+        ~Pin() {
+            if (pins_ != nullptr) {
+                pins_->release(slot_);
+            }
+        }
+
+        // Promise not to touch any block older than `seq` from now on.
+        void set(uint64_t seq) { slot_->store(seq); }
+
+        uint64_t get() const { return slot_->load(); }
+
+    private:
+        BlockPins* pins_;
+        std::atomic<uint64_t>* slot_;
+    };
+
+    // The oldest block sequence any cursor still has pinned.
+    uint64_t oldest() const {
+        std::lock_guard<std::mutex> guard(lock_);
+        uint64_t oldestSeq = Unpinned;
+        for (const auto& slot : slots_) {
+            oldestSeq = std::min(oldestSeq, slot.load());
+        }
+        return oldestSeq;
+    }
+
+private:
+    std::atomic<uint64_t>* acquire(uint64_t seq) {
+        std::lock_guard<std::mutex> guard(lock_);
+        std::atomic<uint64_t>* slot;
+        if (free_.empty()) {
+            slots_.emplace_back(seq);
+            slot = &slots_.back();
+        } else {
+            slot = free_.back();
+            free_.pop_back();
+            slot->store(seq);
+        }
+        return slot;
+    }
+
+    void release(std::atomic<uint64_t>* slot) {
+        std::lock_guard<std::mutex> guard(lock_);
+        slot->store(Unpinned);
+        free_.push_back(slot);
+    }
+
+    mutable std::mutex lock_;
+    // A deque so that slots never move once handed out.
+    std::deque<std::atomic<uint64_t>> slots_;
+    vector<std::atomic<uint64_t>*> free_;
 };
 
 template<class RowBlockType>
 class RowCursorImpl {
 public:
-    RowCursorImpl(std::shared_ptr<RowBlockType> block)
-            : block_{block}, offset_{0} {
+    using RowRef = typename RowBlockType::RowRef;
+
+    // `pin` must already protect `block`. Cursors must not outlive the
+    // buffer they came from.
+    RowCursorImpl(RowBlockType* block, BlockPins::Pin pin, size_t offset = 0)
+            : block_{block}, offset_{offset}, pin_{move(pin)}, decoded_{}, previous_{} {
     }
 
     RowCursorImpl() = delete;
@@ -157,8 +421,8 @@ public:
 
     ~RowCursorImpl() = default;
 
-    const Row& get() const {
-        return block_->at(offset_);
+    RowRef get() const {
+        return readable()->at(offset_);
     }
 
     // Move the cursor forward one row. If it is unable, because there is
@@ -167,28 +431,29 @@ public:
     bool next() {
         auto guard(block_->lockShared());
 
-        // Uses internal data because otherwise locking doesn't work.
-        if ((offset_+1) > block_->offset()) {
-            if (block_->size() < block_->rows.max_size() || !block_->nextBlock) {
-                return false;
-            }
-            offset_ = 0;
-            {
-                // The ordering of oldBlock and guard2 is important.
-                // This is done so that if the ref-count of block_ is zero,
-                // after we move it to nextBlock, it can be safely destructed.
-                // If the ordering was different, then when we tried to destruct
-                // block_, a shared lock would still be held, and
-                // folly::SharedMutex correctly asserts in this situation.
-                std::shared_ptr<RowBlockType> oldBlock = block_;
-                auto guard2 = move(guard);
-                block_ = block_->nextBlock;
-            }
-            return true;
-        } else {
+        // Check for a sealed block before reading its size, so that a row
+        // published just before the block was sealed isn't skipped.
+        bool sealed = block_->sealed();
+        if ((offset_+1) < block_->size()) {
             offset_++;
             return true;
         }
+        if (!sealed) {
+            return false;
+        }
+        // Done with this block.
+        guard.unlock();
+        moveTo(block_->next());
+        return true;
+    }
+
+    // Whether next() would come up empty right now, since no row after
+    // this one has been published yet.
+    bool atEnd() const {
+        auto guard(block_->lockShared());
+        // Read sealed first, as in next().
+        bool sealed = block_->sealed();
+        return !sealed && (offset_+1) >= block_->size();
     }
 
     // Moves this cursor as close to the requested minTime as possible.
@@ -196,43 +461,219 @@ public:
     // satisfies row.ts() > minTime, if false, you must check the cursor
     // to see where it landed.
     bool seek(milliseconds minTime) {
-        auto minMax = block_->minMaxTime();
-        while (minMax.first < minTime && minMax.second < minTime) {
-            if (!block_->nextBlock) {
+        while (true) {
+            // As in next(), a sealed block's time range is final.
+            auto nextBlock = block_->next();
+            auto minMax = block_->minMaxTime();
+            if (!(minMax.first < minTime && minMax.second < minTime) || !nextBlock) {
+                break;
+            }
+            moveTo(nextBlock);
+        }
+        while (true) {
+            // Read sealed first, as in next().
+            bool sealed = block_->sealed();
+            size_t used = block_->size();
+            size_t found = readable()->lowerBound(minTime, offset_);
+            if (found < used) {
+                offset_ = found;
+                return true;
+            }
+            if (used == 0) {
+                return true;
+            }
+            if (!sealed) {
+                offset_ = used - 1;
+                return false;
+            }
+            moveTo(block_->next());
+        }
+    }
+
+    // Moves the cursor to the first row, from the current one on, whose
+    // column equals `value`. Only for blocks with nextMatch(), such as
+    // columnar blocks. If there isn't one yet, it returns false with the
+    // cursor on the last row.
+    bool findNext(size_t column, const ColumnView& value) {
+        while (true) {
+            // Read sealed first, as in next().
+            bool sealed = block_->sealed();
+            size_t used = block_->size();
+            size_t found = readable()->nextMatch(column, value, offset_, used);
+            if (found < used) {
+                offset_ = found;
+                return true;
+            }
+            if (!sealed) {
+                offset_ = used == 0 ? 0 : used - 1;
                 return false;
             }
-            block_ = block_->nextBlock;
-            minMax = block_->minMaxTime();
+            moveTo(block_->next());
         }
-        while (get().valid() && get().ts() < minTime) {
-            if (!next()) { return false; }
+    }
+
+    // Moves the cursor to the first row, from the current one on, whose
+    // INTEGER column is within [low, high]. Blocks whose zone maps rule
+    // them out are passed over without being read, or decompressed. Only
+    // for blocks with zone maps, such as columnar blocks. If there isn't
+    // one yet, it returns false with the cursor on the last row.
+    bool findInRange(size_t column, int64_t low, int64_t high) {
+        while (true) {
+            // Read sealed first, as in next().
+            bool sealed = block_->sealed();
+            size_t used = block_->size();
+            if (block_->mayContain(column, low, high)) {
+                size_t found = readable()->nextInRange(column, low, high, offset_, used);
+                if (found < used) {
+                    offset_ = found;
+                    return true;
+                }
+            }
+            if (!sealed) {
+                offset_ = used == 0 ? 0 : used - 1;
+                return false;
+            }
+            moveTo(block_->next());
         }
-        return true;
     }
 
 private:
-    std::shared_ptr<RowBlockType> block_;
+    // `block` is protected by the current pin, since it's newer than block_.
+    // The pin stays one block behind, so that a row the cursor was on just
+    // before it moved to a new block is still readable, along with the
+    // decompressed copy it may have come from.
+    void moveTo(RowBlockType* block) {
+        pin_.set(block_->sequence());
+        block_ = block;
+        offset_ = 0;
+        previous_ = move(decoded_);
+    }
+
+    // Compressed blocks are decompressed one at a time, when the cursor
+    // first reads from them, and the copy dropped once it's moved on.
+    const RowBlockType* readable() const {
+        if (!block_->compressed()) {
+            return block_;
+        }
+        if (!decoded_) {
+            decoded_ = block_->decompress();
+        }
+        return decoded_.get();
+    }
+
+    RowBlockType* block_;
     size_t offset_;
+    BlockPins::Pin pin_;
+    // Shared, so that copies of a cursor don't decompress the block again.
+    mutable std::shared_ptr<const RowBlockType> decoded_;
+    std::shared_ptr<const RowBlockType> previous_;
 
     friend RowBlockType;
 };
 
 
 
+// What a buffer does when it would go over its byte limit.
+enum class OverflowPolicy {
+    // The limit is soft: the oldest blocks are evicted, but blocks cursors
+    // are still reading, and the last two blocks, are kept regardless.
+    EVICT,
+    // The limit is hard. Rows that don't fit are dropped and counted.
+    DROP,
+    // The limit is hard. Rows that don't fit are refused, and the writer
+    // should stop reading its source until they do.
+    BACKPRESSURE,
+};
+
+inline OverflowPolicy parseOverflowPolicy(const string& name) {
+    auto lcName = lcString(trimQuotes(trimString(name)));
+    if (lcName == "evict") {
+        return OverflowPolicy::EVICT;
+    } else if (lcName == "drop") {
+        return OverflowPolicy::DROP;
+    } else if (lcName == "backpressure") {
+        return OverflowPolicy::BACKPRESSURE;
+    }
+    throw std::invalid_argument("Invalid overflow_policy. Must be evict, drop or backpressure.");
+}
+
+// Where and when a buffer moves sealed blocks out of memory, into mapped
+// segment files. Cursors read spilled blocks just like any other.
+struct SpillOptions {
+    // The directory for segment files. Nothing is spilled if it's empty.
+    string dir;
+    // Spill the oldest blocks while live blocks take more memory than this.
+    size_t memoryBytes{0};
+    // Evict the oldest blocks once more than this has been spilled.
+    size_t maxBytes{std::numeric_limits<size_t>::max()};
+    // How big a segment file to start at a time.
+    size_t segmentBytes{64 << 20};
+};
+
 template<class RowBlockCls, class RowCursorCls=RowCursorImpl<RowBlockCls>>
 class RowBufferImpl {
 public:
-    explicit RowBufferImpl(size_t maxRows, size_t maxBytes, milliseconds maxAge)
-        : maxRows_{maxRows},
+    using BlockOptions = typename RowBlockCls::Options;
+
+    // maxBytes covers everything the buffer allocates: blocks, including
+    // their preallocated storage, and blocks kept for cursors or reuse.
+    // It doesn't cover what's been spilled to disk. It has to leave room for
+    // the tail block, and under a hard limit for the next one as well.
+    explicit RowBufferImpl(size_t maxRows, size_t maxBytes, milliseconds maxAge,
+                           BlockOptions blockOptions = BlockOptions{},
+                           OverflowPolicy overflow = OverflowPolicy::EVICT,
+                           SpillOptions spill = SpillOptions{},
+                           bool compressBlocks = false)
+        : blockOptions_{blockOptions},
+          maxRows_{maxRows},
           maxBytes_{maxBytes},
           maxAge_{maxAge},
+          overflow_{overflow},
+          spill_{move(spill)},
+          compressBlocks_{compressBlocks},
+          blockBytes_{0},
+          rowSeq_{0},
           totalRows_{0},
           totalBytes_{0},
           totalBlocks_{1},
-          headBlock_{RowBlockCls::create()},
-          tailBlock_{headBlock_},
+          retainedBytes_{0},
+          droppedRows_{0},
+          spilledBytes_{0},
+          spilledBlocks_{0},
+          nextSequence_{0},
+          retiredSinceReclaim_{0},
+          headBlock_{nullptr},
+          tailBlock_{nullptr},
+          poolHits_{0},
+          poolMisses_{0},
+          compressedBlocks_{0},
+          compressStop_{false},
           blockWritesLock_{},
           writesBlockedCondition_{} {
+        tailBlock_ = linkBlock(newBlock());
+        headBlock_.store(tailBlock_);
+        blockBytes_ = tailBlock_->byteSize();
+        size_t minBytes = overflow_ == OverflowPolicy::EVICT ? blockBytes_ : 2 * blockBytes_;
+        if (maxBytes_ < minBytes) {
+            throw std::invalid_argument("maxBytes must be at least " + std::to_string(minBytes) +
+                                        " to hold the blocks the buffer needs.");
+        }
+        if (compressBlocks_) {
+            compressor_ = std::thread([this]() { compressLoop(); });
+        }
+    }
+
+    ~RowBufferImpl() {
+        if (compressor_.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(compressLock_);
+                compressStop_ = true;
+            }
+            compressWake_.notify_one();
+            compressor_.join();
+        }
+        // Let go of the pins before the pins go away.
+        compressJobs_.clear();
     }
 
     RowBufferImpl(const RowBufferImpl<RowBlockCls, RowCursorCls>&) = delete;
@@ -240,28 +681,42 @@ public:
     RowBufferImpl<RowBlockCls, RowCursorCls>&
         operator=(const RowBufferImpl<RowBlockCls, RowCursorCls>&) = delete;
 
-    // This always succeeds, unless the process is out of memory.
-    // It's recommended to make that not happen.
+    // This always succeeds with OverflowPolicy::EVICT, unless the process is
+    // out of memory or the row can't be stored at all, which drops it.
+    // Otherwise it returns false if the row didn't fit.
     bool appendRow(Row& row) {
+        if (!RowBlockCls::storable(blockOptions_, row)) {
+            droppedRows_.fetch_add(1);
+            return false;
+        }
         adviseGC();
-        size_t bytes = row.size();
-        bool appended = tailBlock_->appendRow(row);
-
-        while(!appended) {
-            auto nextBlock = RowBlockCls::create();
-            tailBlock_->setNextBlock(nextBlock);
-            tailBlock_ = nextBlock;
-            appended = tailBlock_->appendRow(row);
+        size_t bytes = RowBlockCls::rowBytes(row);
+        if (!hasRoom(bytes)) {
+            return overflowed(1);
+        }
+        size_t tailBytes = tailBlock_->byteSize();
+        if (tailBlock_->appendRow(row)) {
+            totalBytes_.fetch_add(tailBlock_->byteSize() - tailBytes);
+        } else {
+            if (!hasRoomForBlock(bytes)) {
+                return overflowed(1);
+            }
+            // New blocks are filled before they're linked in, so readers never
+            // find an empty block at the end of the chain.
+            auto nextBlock = newBlock();
+            size_t blockBytes = nextBlock->byteSize();
+            nextBlock->appendRow(row);
+            totalBytes_.fetch_add(nextBlock->byteSize() - blockBytes);
+            auto next = linkBlock(move(nextBlock));
+            tailBlock_->seal();
+            tailBlock_->setNextBlock(next);
+            blockSealed(tailBlock_);
+            tailBlock_ = next;
             totalBlocks_.fetch_add(1);
         }
 
         totalRows_.fetch_add(1);
-        totalBytes_.fetch_add(bytes);
-        {
-            std::unique_lock<std::mutex> guard(blockWritesLock_);
-            rowSeq_++;
-        }
-        writesBlockedCondition_.notify_all();
+        notifyReaders();
         return true;
     }
 
@@ -270,28 +725,221 @@ public:
         return appendRow(rowCopy);
     }
 
+    // Appends a batch of rows, waking waiting readers once for the whole
+    // batch rather than once per row. Rows are moved out of `rows`, and the
+    // ones that were appended are erased from it. It returns false if some
+    // didn't fit: with OverflowPolicy::DROP those are dropped too, while with
+    // BACKPRESSURE they're left in `rows` to try again later. Rows that can't
+    // be stored at all are always dropped, since waiting wouldn't help.
+    bool appendRows(vector<Row>& rows) {
+        size_t unstorable = RowBlockCls::dropUnstorable(blockOptions_, rows);
+        if (unstorable > 0) {
+            droppedRows_.fetch_add(unstorable);
+        }
+        if (rows.empty()) {
+            return true;
+        }
+        adviseGC();
+
+        auto pos = rows.begin();
+        while (pos != rows.end()) {
+            auto stop = fittingRows(pos, rows.end());
+            size_t tailBytes = tailBlock_->byteSize();
+            size_t appended = tailBlock_->appendRows(pos, stop);
+            totalBytes_.fetch_add(tailBlock_->byteSize() - tailBytes);
+            pos += appended;
+            if (appended > 0) {
+                continue;
+            }
+            if (stop == pos || !hasRoomForBlock(RowBlockCls::rowBytes(*pos))) {
+                break;
+            }
+            // The tail is full.
+            auto nextBlock = newBlock();
+            size_t blockBytes = nextBlock->byteSize();
+            pos += nextBlock->appendRows(pos, fittingRows(pos, rows.end()));
+            totalBytes_.fetch_add(nextBlock->byteSize() - blockBytes);
+            auto next = linkBlock(move(nextBlock));
+            tailBlock_->seal();
+            tailBlock_->setNextBlock(next);
+            blockSealed(tailBlock_);
+            tailBlock_ = next;
+            totalBlocks_.fetch_add(1);
+        }
+
+        size_t appended = pos - rows.begin();
+        size_t refused = rows.end() - pos;
+        if (overflow_ == OverflowPolicy::DROP) {
+            rows.clear();
+        } else {
+            rows.erase(rows.begin(), pos);
+        }
+        if (appended > 0) {
+            totalRows_.fetch_add(appended);
+            notifyReaders();
+        }
+        return refused == 0 || overflowed(refused);
+    }
+
     // Frees some memory, if it makes sense to do so.
     // This can only free blocks of rows. If the rows in a block violate
     // any of maxAge, maxBytes, or maxRows, then the container won't respect
     // those constraints. A configuration with more granular blocks is
     // recommended in these cases.
+    //
+    // Blocks dropped from the head are retired rather than freed, since
+    // cursors may still be reading them; see reclaim().
     void adviseGC() {
+        auto head = headBlock_.load();
         while (totalRows_ >= maxRows_ ||
-               totalBytes_ > maxBytes_ ||
-               headBlock_->minMaxTime().first < (tailBlock_->minMaxTime().second - maxAge_)) {
-            auto nextBlock = headBlock_->next();
-            if (nextBlock == tailBlock_) {
+               overBytes() ||
+               spilledBytes_ > spill_.maxBytes ||
+               head->minMaxTime().first < (tailBlock_->minMaxTime().second - maxAge_)) {
+            // The tail is never retired, nor is the block before it.
+            auto nextBlock = head->next();
+            if (head == tailBlock_ || nextBlock == tailBlock_) {
                 break;
             }
-            totalRows_.fetch_sub(headBlock_->size());
-            totalBytes_.fetch_sub(headBlock_->byteSize());
+            if (head->spilled()) {
+                spilledBytes_.fetch_sub(head->spilledBytes());
+                spilledBlocks_--;
+            }
+            if (head->compressed()) {
+                compressedBlocks_.fetch_sub(1);
+            }
+            totalRows_.fetch_sub(head->size());
+            totalBytes_.fetch_sub(head->byteSize());
+            retainedBytes_.fetch_add(head->byteSize());
             totalBlocks_.fetch_sub(1);
-            headBlock_ = nextBlock;
+            headBlock_.store(nextBlock);
+            {
+                std::lock_guard<std::mutex> guard(indexLock_);
+                timeIndex_.pop_front();
+            }
+            retired_.push_back(move(blocks_.front()));
+            retiredSinceReclaim_++;
+            blocks_.pop_front();
+            head = nextBlock;
+        }
+        applyCompressed();
+        spillBlocks();
+        // Blocks a stuck cursor pins stay retired, so count new ones rather
+        // than looking through the same pinned blocks on every append.
+        if (retiredSinceReclaim_ >= RetireBatch) {
+            reclaim();
+        }
+    }
+
+    // Moves the oldest sealed blocks to disk while live blocks are using
+    // more memory than the spill options allow. Each block is copied into a
+    // segment, swapped into the chain in its place, and the original retired,
+    // so cursors already on it carry on undisturbed.
+    void spillBlocks() {
+        if (spill_.dir.empty()) {
+            return;
+        }
+        // Spilled blocks are always the oldest, and the tail is never spilled.
+        while (totalBytes_ > spill_.memoryBytes && spilledBlocks_ + 1 < blocks_.size()) {
+            size_t pos = spilledBlocks_;
+            RowBlockCls* block = blocks_[pos].get();
+            std::unique_ptr<RowBlockCls> copy;
+            try {
+                size_t needed = block->spillSize();
+                if (!segment_ || segment_->remaining() < needed) {
+                    segment_ = SpillSegment::create(spill_.dir, std::max(spill_.segmentBytes, needed));
+                }
+                copy = block->spillTo(segment_);
+            } catch (const std::exception& e) {
+                std::cout << "Failed to spill rows: " << e.what() << "\n";
+                return;
+            }
+            if (!copy) {
+                return; /* this kind of block can't be spilled */
+            }
+
+            spilledBytes_.fetch_add(replaceBlock(pos, move(copy))->spilledBytes());
+            spilledBlocks_++;
+        }
+    }
+
+    // Swaps in the compressed copies the background compressor has made,
+    // for blocks that are still live and haven't been replaced since.
+    void applyCompressed() {
+        if (!compressBlocks_) {
+            return;
+        }
+        vector<CompressedBlock> results;
+        {
+            std::lock_guard<std::mutex> guard(compressLock_);
+            swap(results, compressResults_);
+        }
+        for (auto& result : results) {
+            uint64_t first = blocks_.front()->sequence();
+            uint64_t seq = result.copy->sequence();
+            if (seq < first || seq - first >= blocks_.size()) {
+                continue;
+            }
+            size_t pos = seq - first;
+            if (blocks_[pos].get() != result.original) {
+                continue;
+            }
+            replaceBlock(pos, move(result.copy));
+            compressedBlocks_.fetch_add(1);
         }
     }
 
+    // Frees every retired block that no cursor can reach anymore, and
+    // returns how many were freed. Freed blocks go back to the pool, if
+    // there's room, for appends to reuse. Only the writer may call this.
+    size_t reclaim() {
+        retiredSinceReclaim_ = 0;
+        uint64_t oldest = pins_.oldest();
+        size_t freed = 0;
+        // Spilling retires blocks out of order, so look through all of them.
+        for (auto it = retired_.begin(); it != retired_.end();) {
+            auto& block = *it;
+            if (block->sequence() >= oldest) {
+                ++it;
+                continue;
+            }
+            size_t bytes = block->byteSize();
+            // Under a hard limit, memory is worth more than saving an allocation.
+            if (pool_.size() < MaxPooledBlocks && !block->spilled() && !block->compressed() &&
+                (overflow_ == OverflowPolicy::EVICT || memoryBytes() <= maxBytes_)) {
+                block->reset();
+                bytes -= block->byteSize();
+                pool_.push_back(move(block));
+            }
+            retainedBytes_.fetch_sub(bytes);
+            it = retired_.erase(it);
+            freed++;
+        }
+        return freed;
+    }
+
+    // Rows in live blocks. Safe to call from any thread, unlike stats().
+    size_t totalRows() const {
+        return totalRows_.load();
+    }
+
+    // Everything the buffer has allocated: live blocks plus the ones
+    // retired or pooled.
+    size_t memoryBytes() const {
+        return totalBytes_.load() + retainedBytes_.load();
+    }
+
+    // Returns a token that changes every time a row is appended.
+    // Take this before checking a cursor for new rows, then hand it to
+    // waitForWrite() so a row appended in between is never missed.
+    size_t writeSequence() const {
+        return rowSeq_.load();
+    }
+
     bool waitForWrite(milliseconds maxWait=0ms) {
-        size_t curSeq = rowSeq_.load();
+        return waitForWrite(rowSeq_.load(), maxWait);
+    }
+
+    bool waitForWrite(size_t curSeq, milliseconds maxWait=0ms) {
         auto checkSequence = [curSeq, this]() {
             std::cout << "rowSeq_:" << rowSeq_.load() << " curSeq:" << curSeq << "\n";
             return rowSeq_.load() != curSeq;
@@ -305,37 +953,296 @@ public:
         return true;
     }
 
+    // Cursors may be created from any thread, while the head is only ever
+    // advanced by the writer.
+    // The cursor pins every block until it knows where the head is, so the
+    // head can't be freed between loading it and pinning it.
     RowCursorCls getCursor() const {
-        return RowCursorCls(headBlock_);
+        BlockPins::Pin pin(&pins_, 0);
+        auto head = headBlock_.load();
+        pin.set(head->sequence());
+        return RowCursorCls(head, move(pin));
+    }
+
+    // A cursor on the first row with ts >= minTime. If there's no such row
+    // yet, the cursor is left on the last row, so that its next() is the
+    // next row to arrive. Finding the block is a binary search over the
+    // blocks' time ranges, and then over the rows in it.
+    RowCursorCls getCursor(milliseconds minTime) const {
+        BlockPins::Pin pin(&pins_, 0);
+        RowBlockCls* block;
+        {
+            std::lock_guard<std::mutex> guard(indexLock_);
+            auto found = std::partition_point(timeIndex_.begin(), timeIndex_.end(),
+                [minTime](const BlockTime& entry) {
+                    return std::max(entry.maxBefore, entry.block->minMaxTime().second) < minTime;
+                });
+            if (found == timeIndex_.end()) {
+                --found;
+            }
+            block = found->block;
+            pin.set(block->sequence());
+        }
+        RowCursorCls cursor(block, move(pin));
+        cursor.seek(minTime);
+        return cursor;
     }
 
     struct RowBufferStats {
         size_t totalRows;
+        // The memory held by live blocks.
         size_t totalBytes;
         size_t totalBlocks;
+        // Blocks dropped from the buffer but still held for some cursor.
+        size_t retiredBlocks;
+        // New blocks that were taken from the pool, and that weren't.
+        size_t poolHits;
+        size_t poolMisses;
+        // The memory held by retired and pooled blocks.
+        size_t retainedBytes;
+        // Rows refused under OverflowPolicy::DROP.
+        size_t droppedRows;
+        // What live blocks take up in spill segments.
+        size_t spilledBytes;
+        // Live blocks that have been compressed.
+        size_t compressedBlocks;
     };
 
+    // Only the writer may call this, as it looks at the retired list.
     RowBufferStats stats() const {
-        return RowBufferStats{totalRows_.load(), totalBytes_.load(), totalBlocks_.load()};
+        return RowBufferStats{totalRows_.load(), totalBytes_.load(), totalBlocks_.load(), retired_.size(),
+                              poolHits_.load(), poolMisses_.load(), retainedBytes_.load(), droppedRows_.load(),
+                              spilledBytes_.load(), compressedBlocks_.load()};
     };
 
     size_t maxRows() const { return maxRows_; }
     size_t maxBytes() const { return maxBytes_; }
     milliseconds maxAge() const { return maxAge_; }
+    OverflowPolicy overflowPolicy() const { return overflow_; }
 
 private:
+    // How many blocks to retire before trying to free any of them.
+    static constexpr size_t RetireBatch = 4;
+    // How many freed blocks to keep around for reuse. Freeing happens in
+    // batches of RetireBatch, so this covers a couple of batches.
+    static constexpr size_t MaxPooledBlocks = 2 * RetireBatch;
+
+    // Swaps `copy` into the chain in place of the sealed block at `pos`, and
+    // retires the original. A cursor already on the original finishes
+    // reading it, then follows its next link as usual.
+    RowBlockCls* replaceBlock(size_t pos, std::unique_ptr<RowBlockCls> copy) {
+        RowBlockCls* block = blocks_[pos].get();
+        RowBlockCls* replacement = copy.get();
+        replacement->setNextBlock(block->next());
+        if (pos == 0) {
+            headBlock_.store(replacement);
+        } else {
+            blocks_[pos-1]->setNextBlock(replacement);
+        }
+        {
+            std::lock_guard<std::mutex> guard(indexLock_);
+            timeIndex_[pos].block = replacement;
+        }
+        totalBytes_.fetch_sub(block->byteSize());
+        totalBytes_.fetch_add(replacement->byteSize());
+        retainedBytes_.fetch_add(block->byteSize());
+        retired_.push_back(move(blocks_[pos]));
+        retiredSinceReclaim_++;
+        blocks_[pos] = move(copy);
+        return replacement;
+    }
+
+    // Hands a block the writer is done with to the compressor, which holds
+    // a pin on it until it's done.
+    void blockSealed(RowBlockCls* block) {
+        if (!compressBlocks_) {
+            return;
+        }
+        CompressJob job{block, BlockPins::Pin(&pins_, block->sequence())};
+        {
+            std::lock_guard<std::mutex> guard(compressLock_);
+            compressJobs_.push_back(move(job));
+        }
+        compressWake_.notify_one();
+    }
+
+    void compressLoop() {
+        std::unique_lock<std::mutex> guard(compressLock_);
+        while (true) {
+            compressWake_.wait(guard, [this]() { return compressStop_ || !compressJobs_.empty(); });
+            if (compressStop_) {
+                return;
+            }
+            auto job = move(compressJobs_.front());
+            compressJobs_.pop_front();
+            guard.unlock();
+            auto copy = job.block->compress();
+            guard.lock();
+            if (copy) {
+                compressResults_.push_back(CompressedBlock{job.block, move(copy)});
+            }
+        }
+    }
+
+    // The block's memory is counted as live from here on.
+    std::unique_ptr<RowBlockCls> newBlock() {
+        if (pool_.empty()) {
+            poolMisses_.fetch_add(1);
+            auto block = RowBlockCls::create(blockOptions_);
+            totalBytes_.fetch_add(block->byteSize());
+            return block;
+        }
+        poolHits_.fetch_add(1);
+        auto block = move(pool_.back());
+        pool_.pop_back();
+        retainedBytes_.fetch_sub(block->byteSize());
+        totalBytes_.fetch_add(block->byteSize());
+        return block;
+    }
+
+    // Whether to evict for space. A hard limit keeps room for one more block
+    // on top of the live ones, so that ingest only stalls while cursors hold
+    // on to retired blocks.
+    bool overBytes() const {
+        if (overflow_ == OverflowPolicy::EVICT) {
+            return totalBytes_ > maxBytes_;
+        }
+        return totalBytes_ + blockBytes_ > maxBytes_;
+    }
+
+    // Whether `bytes` more fits under a hard limit, freeing what it can first.
+    bool hasRoom(size_t bytes) {
+        if (overflow_ == OverflowPolicy::EVICT) {
+            return true;
+        }
+        if (memoryBytes() + bytes > maxBytes_) {
+            reclaim();
+        }
+        return memoryBytes() + bytes <= maxBytes_;
+    }
+
+    // Whether a new block, and a row of `rowBytes` in it, fits.
+    bool hasRoomForBlock(size_t rowBytes) {
+        if (overflow_ == OverflowPolicy::EVICT) {
+            return true;
+        }
+        if (!hasRoom(rowBytes)) {
+            return false;
+        }
+        // Reusing a pooled block costs nothing more.
+        return !pool_.empty() || hasRoom(blockBytes_ + rowBytes);
+    }
+
+    // The end of the longest run of rows from `begin` that fits.
+    template<class RowIter>
+    RowIter fittingRows(RowIter begin, RowIter end) {
+        if (overflow_ == OverflowPolicy::EVICT) {
+            return end;
+        }
+        size_t bytes = 0;
+        for (; begin != end; ++begin) {
+            bytes += RowBlockCls::rowBytes(*begin);
+            if (!hasRoom(bytes)) {
+                break;
+            }
+        }
+        return begin;
+    }
+
+    bool overflowed(size_t rows) {
+        if (overflow_ == OverflowPolicy::DROP) {
+            droppedRows_.fetch_add(rows);
+        }
+        return false;
+    }
+
+    void notifyReaders() {
+        {
+            std::unique_lock<std::mutex> guard(blockWritesLock_);
+            rowSeq_++;
+        }
+        writesBlockedCondition_.notify_all();
+    }
+
+    RowBlockCls* linkBlock(std::unique_ptr<RowBlockCls> block) {
+        block->setSequence(nextSequence_++);
+        blocks_.push_back(move(block));
+        BlockTime entry{blocks_.back().get(), milliseconds::min()};
+        std::lock_guard<std::mutex> guard(indexLock_);
+        if (!timeIndex_.empty()) {
+            // The previous block is full, so its time range is final.
+            const auto& prev = timeIndex_.back();
+            entry.maxBefore = std::max(prev.maxBefore, prev.block->minMaxTime().second);
+        }
+        timeIndex_.push_back(entry);
+        return entry.block;
+    }
 
+    // The live blocks, in order, along with the latest timestamp found in
+    // any block before each one. Taking the max with a block's own max
+    // time gives a sorted key even when rows arrive out of order.
+    struct BlockTime {
+        RowBlockCls* block;
+        milliseconds maxBefore;
+    };
+
+    const BlockOptions blockOptions_;
     const size_t maxRows_;
     const size_t maxBytes_;
     const milliseconds maxAge_;
+    const OverflowPolicy overflow_;
+    const SpillOptions spill_;
+    const bool compressBlocks_;
+    // What a new, empty block costs.
+    size_t blockBytes_;
 
     std::atomic_size_t rowSeq_;
     std::atomic_size_t totalRows_;
     std::atomic_size_t totalBytes_;
     std::atomic_size_t totalBlocks_;
+    std::atomic_size_t retainedBytes_;
+    std::atomic_size_t droppedRows_;
+    std::atomic_size_t spilledBytes_;
+    // How many blocks at the front of blocks_ have been spilled.
+    size_t spilledBlocks_;
+    // The segment blocks are currently being spilled into.
+    std::shared_ptr<SpillSegment> segment_;
+
+    uint64_t nextSequence_;
+
+    // Live blocks, oldest first, and blocks waiting for cursors to move on.
+    std::deque<std::unique_ptr<RowBlockCls>> blocks_;
+    std::deque<std::unique_ptr<RowBlockCls>> retired_;
+    // Blocks retired since reclaim() last looked through retired_.
+    size_t retiredSinceReclaim_;
+    vector<std::unique_ptr<RowBlockCls>> pool_;
+    mutable BlockPins pins_;
+
+    mutable std::mutex indexLock_;
+    std::deque<BlockTime> timeIndex_;
 
-    std::shared_ptr<RowBlockCls> headBlock_;
-    std::shared_ptr<RowBlockCls> tailBlock_;
+    std::atomic<RowBlockCls*> headBlock_;
+    RowBlockCls* tailBlock_;
+
+    std::atomic_size_t poolHits_;
+    std::atomic_size_t poolMisses_;
+
+    // The background compressor, and the work going to and from it.
+    struct CompressJob {
+        RowBlockCls* block;
+        BlockPins::Pin pin;
+    };
+    struct CompressedBlock {
+        RowBlockCls* original;
+        std::unique_ptr<RowBlockCls> copy;
+    };
+    std::atomic_size_t compressedBlocks_;
+    std::mutex compressLock_;
+    std::condition_variable compressWake_;
+    std::deque<CompressJob> compressJobs_;
+    vector<CompressedBlock> compressResults_;
+    bool compressStop_;
+    std::thread compressor_;
 
     std::mutex blockWritesLock_;
     std::condition_variable writesBlockedCondition_;
@@ -0,0 +1,208 @@
+#include "RowParser.h"
+
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const char* findSeparatorScalar(const char* begin, const char* end) {
+    auto pos = static_cast<const char*>(std::memchr(begin, ColSep, end - begin));
+    return pos == nullptr ? end : pos;
+}
+
+bool parseIntegerScalar(const char* begin, const char* end, const char* /* limit */, int64_t& out) {
+    bool negative = false;
+    if (begin != end && *begin == '-') {
+        negative = true;
+        begin++;
+    }
+    if (begin == end) {
+        return false;
+    }
+    // Accumulate as a negative number so that INT64_MIN parses.
+    int64_t value = 0;
+    constexpr int64_t minValue = std::numeric_limits<int64_t>::min();
+    for (; begin != end; begin++) {
+        unsigned digit = static_cast<unsigned char>(*begin) - '0';
+        if (digit > 9) {
+            return false;
+        }
+        if (value < (minValue + static_cast<int64_t>(digit)) / 10) {
+            return false;
+        }
+        value = value * 10 - digit;
+    }
+    if (!negative) {
+        if (value == minValue) {
+            return false;
+        }
+        value = -value;
+    }
+    out = value;
+    return true;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse2")))
+const char* findSeparatorSse2(const char* begin, const char* end) {
+    const __m128i sep = _mm_set1_epi8(ColSep);
+    while (end - begin >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, sep));
+        if (mask != 0) {
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 16;
+    }
+    return findSeparatorScalar(begin, end);
+}
+
+__attribute__((target("avx2")))
+const char* findSeparatorAvx2(const char* begin, const char* end) {
+    const __m256i sep = _mm256_set1_epi8(ColSep);
+    while (end - begin >= 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, sep));
+        if (mask != 0) {
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 32;
+    }
+    return findSeparatorSse2(begin, end);
+}
+
+// Shuffle masks that right-align the first n bytes of a register, zeroing
+// everything in front of them.
+struct AlignMasks {
+    alignas(16) int8_t masks[17][16];
+    AlignMasks() {
+        for (int n = 0; n <= 16; n++) {
+            for (int j = 0; j < 16; j++) {
+                masks[n][j] = j < 16 - n ? static_cast<int8_t>(0x80) : static_cast<int8_t>(j - (16 - n));
+            }
+        }
+    }
+};
+const AlignMasks alignMasks;
+
+// Converts up to 16 digits at once: pairs of digits are combined into
+// 2 digit lanes, then 4, then 8, and the two 8 digit halves are joined.
+__attribute__((target("sse4.2")))
+bool parseIntegerSse42(const char* begin, const char* end, const char* limit, int64_t& out) {
+    const char* digits = begin;
+    bool negative = false;
+    if (digits != end && *digits == '-') {
+        negative = true;
+        digits++;
+    }
+    size_t n = end - digits;
+    if (n == 0 || n > 16 || limit - digits < 16) {
+        return parseIntegerScalar(begin, end, limit, out);
+    }
+
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(digits));
+    chunk = _mm_sub_epi8(chunk, _mm_set1_epi8('0'));
+    // Anything that isn't a digit ends up above 9, once treated as unsigned.
+    __m128i notDigit = _mm_subs_epu8(chunk, _mm_set1_epi8(9));
+    unsigned digitMask = _mm_movemask_epi8(_mm_cmpeq_epi8(notDigit, _mm_setzero_si128()));
+    unsigned wanted = (1u << n) - 1;
+    if ((digitMask & wanted) != wanted) {
+        return false;
+    }
+
+    chunk = _mm_shuffle_epi8(chunk, _mm_load_si128(reinterpret_cast<const __m128i*>(alignMasks.masks[n])));
+    __m128i pairs = _mm_maddubs_epi16(chunk, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    quads = _mm_packus_epi32(quads, quads);
+    __m128i octets = _mm_madd_epi16(quads, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+
+    int64_t high = static_cast<uint32_t>(_mm_cvtsi128_si32(octets));
+    int64_t low = static_cast<uint32_t>(_mm_extract_epi32(octets, 1));
+    int64_t value = high * 100000000 + low;
+    out = negative ? -value : value;
+    return true;
+}
+
+#endif
+
+} // namespace
+
+ParserIsa bestParserIsa() {
+#if defined(__x86_64__)
+    static const ParserIsa best = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return ParserIsa::AVX2;
+        } else if (__builtin_cpu_supports("sse4.2")) {
+            return ParserIsa::SSE42;
+        }
+        return ParserIsa::SCALAR;
+    }();
+    return best;
+#else
+    return ParserIsa::SCALAR;
+#endif
+}
+
+const char* parserIsaName(ParserIsa isa) {
+    switch (isa) {
+        case ParserIsa::SCALAR: return "scalar";
+        case ParserIsa::SSE42: return "sse4.2";
+        case ParserIsa::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+const char* parseStatusMessage(ParseStatus status) {
+    switch (status) {
+        case ParseStatus::OK: return "OK";
+        case ParseStatus::WRONG_COLUMN_COUNT: return "Message has wrong column count.";
+        case ParseStatus::BAD_INTEGER: return "Invalid message. Expected INTEGER, got TEXT.";
+    }
+    return "unknown";
+}
+
+TextRowParser::TextRowParser(vector<ColumnType> types, ParserIsa isa)
+    : types_{move(types)},
+      isa_{std::min(isa, bestParserIsa())},
+      findSeparator_{findSeparatorScalar},
+      parseInteger_{parseIntegerScalar} {
+#if defined(__x86_64__)
+    if (isa_ == ParserIsa::AVX2) {
+        findSeparator_ = findSeparatorAvx2;
+        parseInteger_ = parseIntegerSse42;
+    } else if (isa_ == ParserIsa::SSE42) {
+        findSeparator_ = findSeparatorSse2;
+        parseInteger_ = parseIntegerSse42;
+    }
+#endif
+}
+
+ParseStatus TextRowParser::parse(folly::StringPiece data, vector<ColumnView>& columns) const {
+    const char* pos = data.begin();
+    const char* end = data.end();
+    columns.reserve(columns.size() + types_.size());
+    for (size_t i=0; i < types_.size(); i++) {
+        const char* sep = findSeparator_(pos, end);
+        if (types_[i] == ColumnType::INTEGER) {
+            int64_t value;
+            if (!parseInteger_(pos, sep, end, value)) {
+                return ParseStatus::BAD_INTEGER;
+            }
+            columns.emplace_back(ColumnType::INTEGER, folly::StringPiece(), value);
+        } else {
+            columns.emplace_back(ColumnType::TEXT, folly::StringPiece(pos, sep), -1);
+        }
+        if (sep == end) {
+            return i+1 == types_.size() ? ParseStatus::OK : ParseStatus::WRONG_COLUMN_COUNT;
+        }
+        pos = sep + 1;
+    }
+    // There's still a separator left, so there are more columns than the table has.
+    return ParseStatus::WRONG_COLUMN_COUNT;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#pragma once
+
+#include "setab/Row.h"
+#include "setab/Util.h"
+
+#include <folly/Range.h>
+
+// The instruction sets the text row parser knows how to use.
+// The best one the CPU supports is picked at runtime.
+enum class ParserIsa {
+    SCALAR,
+    SSE42,
+    AVX2,
+};
+
+ParserIsa bestParserIsa();
+const char* parserIsaName(ParserIsa isa);
+
+enum class ParseStatus {
+    OK,
+    WRONG_COLUMN_COUNT,
+    BAD_INTEGER,
+};
+
+const char* parseStatusMessage(ParseStatus status);
+
+// Parses rows in the \036 delimited text format described in Row.h.
+// Columns are decoded straight into the output as the separators are
+// found, TEXT columns are views into the input, and bad rows are reported
+// through the return value rather than by throwing.
+class TextRowParser {
+public:
+    TextRowParser() : TextRowParser(vector<ColumnType>{}) {}
+    explicit TextRowParser(vector<ColumnType> types, ParserIsa isa = bestParserIsa());
+
+    ParseStatus parse(folly::StringPiece data, vector<ColumnView>& columns) const;
+
+    ParserIsa isa() const { return isa_; }
+
+    // Exposed for testing. Returns `end` if there's no separator.
+    const char* findSeparator(const char* begin, const char* end) const {
+        return findSeparator_(begin, end);
+    }
+    // Exposed for testing. Accepts an optional '-' and 1 to 19 digits.
+    // `limit` is how far past `begin` it's safe to read, which lets the
+    // vector paths load a whole register at once.
+    bool parseInteger(const char* begin, const char* end, const char* limit, int64_t& out) const {
+        return parseInteger_(begin, end, limit, out);
+    }
+
+private:
+    using FindSeparatorFn = const char* (*)(const char*, const char*);
+    using ParseIntegerFn = bool (*)(const char*, const char*, const char*, int64_t&);
+
+    vector<ColumnType> types_;
+    ParserIsa isa_;
+    FindSeparatorFn findSeparator_;
+    ParseIntegerFn parseInteger_;
+};
@@ -23,33 +23,78 @@
 
 #include "Setab.h"
 
+// sleep_for() and comparisons take these by reference, so C++14 needs them
+// defined somewhere.
+constexpr milliseconds Setab::BackpressureWait;
+constexpr milliseconds Setab::FlushIdleWait;
+constexpr milliseconds Setab::RateInterval;
+
+thread_local StreamProbe* StreamProbe::current_ = nullptr;
+
 // Sqlite3 C-interface bridge functions
 namespace {
+// For text SQLite reads straight out of a row block. See setab_column().
+void keepText(void*) {}
+
+// SQLite wants a vtab per connection. Connections to the same table share
+// one Setab through the registry, so there's a single set of sockets and a
+// single buffer no matter how many threads read it.
+struct SetabVtab {
+    sqlite3_vtab base; /* Must come first */
+    std::shared_ptr<Setab> table;
+};
+
+Setab* tableOf(sqlite3_vtab* pVTab) {
+    return reinterpret_cast<SetabVtab*>(pVTab)->table.get();
+}
+
+sqlite3_vtab* attachTable(std::shared_ptr<Setab> table) {
+    auto* vtab = new SetabVtab{{}, move(table)};
+    return &vtab->base;
+}
+
 int setab_create(sqlite3* db, void* pAux, int argc, const char* const* argv, sqlite3_vtab** ppVTab, char** pzErr) {
     try {
         SetabRegistry* registry = static_cast<SetabRegistry*>(pAux);
-        auto* tab = new Setab(db, registry, argv[2], vector<string>(argv+3, argv+argc));
-        *ppVTab = tab->vTableBase();
-    } catch (const std::runtime_error& ex) {
+        auto table = std::make_shared<Setab>(db, registry, argv[2], vector<string>(argv+3, argv+argc));
+        registry->addTable(argv[2], table);
+        *ppVTab = attachTable(move(table));
+    } catch (const std::exception& ex) {
+        // Bad options throw logic errors, and setup failures runtime ones.
+        // Either way SQLite reports the message to whoever ran the CREATE.
+        *pzErr = sqlite3_mprintf("%s", ex.what());
         return SQLITE_ERROR;
     }
     return SQLITE_OK;
 }
 
+int setab_connect(sqlite3* db, void* pAux, int argc, const char* const* argv, sqlite3_vtab** ppVTab, char** pzErr) {
+    SetabRegistry* registry = static_cast<SetabRegistry*>(pAux);
+    auto table = registry->getTable(argv[2]);
+    if (table == nullptr) {
+        // First connection to a table that's already in the schema.
+        return setab_create(db, pAux, argc, argv, ppVTab, pzErr);
+    }
+    if (sqlite3_declare_vtab(db, table->tableSchema().c_str())) {
+        return SQLITE_ERROR;
+    }
+    *ppVTab = attachTable(move(table));
+    return SQLITE_OK;
+}
+
 int setab_destroy(sqlite3_vtab *pVTab) {
-    Setab* table = reinterpret_cast<Setab*>(pVTab);
-    delete table;
+    delete reinterpret_cast<SetabVtab*>(pVTab);
     return SQLITE_OK;
 }
 
 int setab_bestindex(sqlite3_vtab* pVTab, sqlite3_index_info* pIndexInfo) {
-    Setab* table = reinterpret_cast<Setab*>(pVTab);
+    Setab* table = tableOf(pVTab);
     table->bestIndex(pIndexInfo);
     return SQLITE_OK;
 }
 
 int setab_open(sqlite3_vtab* pVTab, sqlite3_vtab_cursor** ppCursor) {
-    Setab* table = reinterpret_cast<Setab*>(pVTab);
+    Setab* table = tableOf(pVTab);
     if (table->isWriteOnly()) {
         return SQLITE_ERROR;
     }
@@ -72,25 +117,37 @@ int setab_eof(sqlite3_vtab_cursor* pSetabCursor) {
 
 int setab_filter(sqlite3_vtab_cursor* pSetabCursor, int idxNum, const char* idxStr, int argc, sqlite3_value** argv) {
     SetabCursor* cursor = reinterpret_cast<SetabCursor*>(pSetabCursor);
-    return cursor->filter(idxNum, vector<sqlite3_value*>(argv, argv+argc));
+    int rc = cursor->filter(idxNum, idxStr, vector<sqlite3_value*>(argv, argv+argc));
+    cursor->noteProgress();
+    return rc;
 }
 
 int setab_next(sqlite3_vtab_cursor* pSetabCursor) {
     SetabCursor* cursor = reinterpret_cast<SetabCursor*>(pSetabCursor);
     cursor->nextRow();
+    cursor->noteProgress();
     return SQLITE_OK;
 }
 
 int setab_column(sqlite3_vtab_cursor* pSetabCursor, sqlite3_context* pContext, int N) {
     SetabCursor* cursor = reinterpret_cast<SetabCursor*>(pSetabCursor);
     //std::cout << "xColumn(" << N << "): ";
-    const auto& col = cursor->row().columns()[N];
+    auto row = cursor->row();
+    if (N < 0 || static_cast<size_t>(N) >= row.columnCount()) {
+        return SQLITE_ERROR;
+    }
+    auto col = row.column(N);
     if (std::get<0>(col) == ColumnType::INTEGER) {
         //std::cout << std::get<2>(col) << "\n";
         sqlite3_result_int64(pContext, std::get<2>(col));
     } else if(std::get<0>(col) == ColumnType::TEXT) {
         //std::cout << std::get<1>(col) << "\n";
-        sqlite3_result_text(pContext, std::get<1>(col).data(), std::get<1>(col).size(), SQLITE_TRANSIENT);
+        // Interned text lives as long as the table. Other text stays put
+        // while the cursor is on its block, or has just left it, which
+        // covers SQLite using the value in place. Unlike SQLITE_STATIC, a
+        // destructor makes SQLite copy it if it keeps it any longer.
+        sqlite3_result_text(pContext, std::get<1>(col).data(), std::get<1>(col).size(),
+                            row.interned(N) ? SQLITE_STATIC : keepText);
     } else {
         return SQLITE_ERROR;
     }
@@ -104,7 +161,7 @@ int setab_rowid(sqlite3_vtab_cursor* pSetabCursor, sqlite_int64* pRowid) {
 }
 
 int setab_update(sqlite3_vtab* pVTab, int argc, sqlite3_value **argv, sqlite_int64* pRowid) {
-    Setab* table = reinterpret_cast<Setab*>(pVTab);
+    Setab* table = tableOf(pVTab);
     if (table->isReadOnly()) {
         return SQLITE_READONLY;
     }
@@ -116,8 +173,30 @@ int setab_update(sqlite3_vtab* pVTab, int argc, sqlite3_value **argv, sqlite_int
     return table->write(pRowid, vector<sqlite3_value*>(argv+2, argv+argc));
 }
 
+// Streams have no transactions to speak of, but the hooks are how a table
+// hears about commits, which is when it sends the rows it's been batching.
+// SQLite only calls xSync and xCommit on tables that have an xBegin.
+int setab_begin(sqlite3_vtab* pVTab) {
+    return SQLITE_OK;
+}
+
+int setab_sync(sqlite3_vtab* pVTab) {
+    Setab* table = tableOf(pVTab);
+    return table->forWrite() ? table->flush() : SQLITE_OK;
+}
+
+// Rows already sent can't be taken back, and the batches hold every
+// connection's rows, so a rollback sends the rest too.
+int setab_commit(sqlite3_vtab* pVTab) {
+    Setab* table = tableOf(pVTab);
+    if (table->forWrite()) {
+        table->flush();
+    }
+    return SQLITE_OK;
+}
+
 int setab_rename(sqlite3_vtab* pVTab, const char* zNew) {
-    Setab* table = reinterpret_cast<Setab*>(pVTab);
+    Setab* table = tableOf(pVTab);
     table->rename(zNew); 
     return SQLITE_OK;
 }
@@ -127,7 +206,7 @@ sqlite3_module* Sqlite3SetabModule() {
     static sqlite3_module module {
         .iVersion = 1,
         .xCreate = setab_create,
-        .xConnect = setab_create,
+        .xConnect = setab_connect,
         .xBestIndex = setab_bestindex,
         .xDisconnect = setab_destroy,
         .xDestroy = setab_destroy,
@@ -139,10 +218,10 @@ sqlite3_module* Sqlite3SetabModule() {
         .xColumn = setab_column,
         .xRowid = setab_rowid,
         .xUpdate = setab_update,
-        .xBegin = nullptr,
-        .xSync = nullptr,
-        .xCommit = nullptr,
-        .xRollback = nullptr,
+        .xBegin = setab_begin,
+        .xSync = setab_sync,
+        .xCommit = setab_commit,
+        .xRollback = setab_commit,
         .xFindFunction = nullptr,
         .xRename = setab_rename,
         .xSavepoint = nullptr,
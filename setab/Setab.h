@@ -24,10 +24,18 @@
 #pragma once
 
 #include "setab/Util.h"
+#include "setab/BlockCodec.h"
+#include "setab/ColumnarRowBlock.h"
 #include "setab/Registry.h"
 #include "setab/Row.h"
+#include "setab/RowParser.h"
 #include "setab/RowBuffer.h"
 #include "setab/Sqlite.h"
+#include "setab/WireFormat.h"
+
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
 
 #include <folly/Conv.h>
 #include <folly/FileUtil.h>
@@ -35,7 +43,6 @@
 #include <folly/Synchronized.h>
 
 class Setab {
-    sqlite3_vtab vTableBase_; /* Must come first */
     sqlite3* db_;
     SetabRegistry* registry_;
 
@@ -43,45 +50,133 @@ class Setab {
     vector<Column> columns_;
     vector<string> rawTableArgs_;
 
+    // Either the table's own context, or the registry's shared one.
     void* zctx_;
+    bool ownsContext_;
     void* readSock_;
-    void* writeSock_;
+    // A message on stopSend_ tells the ingest thread to finish up. The
+    // context may be shared, so shutting it down isn't an option.
+    void* stopRecv_;
+    void* stopSend_;
+
+    // A socket to send rows down, along with the rows written but not sent
+    // yet, encoded as they'll go out.
+    struct NextHop {
+        void* sock;
+        string rows;
+        string lengths;
+        size_t count;
+    };
+    // With partition_by there's one of these per next hop service, and a
+    // row goes to the one its key hashes to. Otherwise there's just the
+    // one, connected to all of them, which zmq spreads rows over.
+    vector<NextHop> nextHops_;
+    // Connections on other threads may insert at the same time, and zmq
+    // sockets aren't thread safe. Guards the outbound batches too.
+    std::mutex writeLock_;
+
+    // A batch is sent as one message once it has sendBatchRows_ rows or
+    // sendBatchBytes_ worth, when SQLite commits, or sendLinger_ after the
+    // first row waiting in any batch was written, whichever comes first.
+    // Batching isn't transactional: the batches are shared by every
+    // connection, and rows can go out before their transaction commits.
+    size_t outCount_;
+    milliseconds outStarted_;
+    size_t sendBatchRows_;
+    size_t sendBatchBytes_;
+    milliseconds sendLinger_;
+    std::condition_variable flushWake_;
 
     int listenPort_;
-    string nextHopService_;
+    vector<string> listenEndpoints_;
+    vector<string> nextHopServices_;
+    // The column rows are partitioned on, or -1.
+    int partitionColumn_;
+    WireFormat wireFormat_;
+    TextRowParser textParser_;
 
     int lingerMs_; /* int for compat with zmq */
     int batchSize_;
+    size_t drainBatchSize_;
     
     int64_t batchStart_;
     int64_t currentRowId_;
 
     milliseconds windowSizeMs_;
 
-    std::unique_ptr<RowBuffer> rows_;
+    std::shared_ptr<const ColumnarLayout> layout_;
+    std::unique_ptr<ColumnarRowBuffer> rows_;
+
+    // Set when the table is going away, for the ingest thread to notice
+    // while it's holding off on a full buffer.
+    std::atomic<bool> stopping_;
+
+    // Rows per second coming off the socket, and when rows last arrived, for
+    // bestIndex() to guess how many rows a scan will see. Only the ingest
+    // thread writes them.
+    std::atomic<double> ingestRate_;
+    std::atomic<int64_t> lastIngestMs_;
+    size_t rateRows_;
+    milliseconds rateMark_;
+
+    // Drains readSock_ into rows_ for listening tables. It owns readSock_
+    // once started, and closes it on the way out.
+    std::thread ingestThread_;
+
+    // Sends batches that have lingered long enough, for tables that batch.
+    std::thread flushThread_;
 public:
     Setab(sqlite3* db, SetabRegistry* registry, string tableName, vector<string> rawTableArgs)
-        : vTableBase_{},
-          db_{db},
+        : db_{db},
           registry_{registry},
           tableName_{tableName},
           columns_{{"ts", ColumnType::INTEGER}},
           rawTableArgs_{rawTableArgs},
           zctx_{nullptr},
+          ownsContext_{false},
           readSock_{nullptr},
-          writeSock_{nullptr},
+          stopRecv_{nullptr},
+          stopSend_{nullptr},
+          nextHops_{},
+          writeLock_{},
+          outCount_{0},
+          outStarted_{0},
+          sendBatchRows_{1},
+          sendBatchBytes_{64 << 10},
+          sendLinger_{10},
+          flushWake_{},
           listenPort_{0},
-          nextHopService_{},
+          listenEndpoints_{},
+          nextHopServices_{},
+          partitionColumn_{-1},
+          wireFormat_{WireFormat::TEXT},
+          textParser_{},
           lingerMs_{1000},
           batchSize_{10000},
+          drainBatchSize_{1000},
           batchStart_{0},
           currentRowId_{0},
           windowSizeMs_{100*1000},
-          rows_{nullptr} {
+          layout_{},
+          rows_{nullptr},
+          stopping_{false},
+          ingestRate_{0.0},
+          lastIngestMs_{0},
+          rateRows_{0},
+          rateMark_{nowMs()},
+          ingestThread_{},
+          flushThread_{} {
 
         size_t maxBufferedRows = 100000;
-        size_t maxBufferedBytes = 100000;
+        size_t maxBufferedBytes = 64 << 20;
         milliseconds maxBufferedAge = 30min;
+        OverflowPolicy overflowPolicy = OverflowPolicy::EVICT;
+        SpillOptions spill;
+        bool compressBlocks = false;
+        string partitionBy;
+        bool sharedContext = false;
+        vector<string> internedColumns;
+        vector<string> indexedColumns;
         std::cout << "Create debug..\n";
         for (size_t i=0; i<rawTableArgs_.size(); i++) {
             std::cout << "arg:" << i << " value:'" << rawTableArgs_[i] << "'\n";
@@ -141,25 +236,81 @@ public:
                 listenPort_ = std::stoi(value); // Allow exceptions to propagate to fail table creation.
             } else if (key == "next_hop_service") {
 
-                nextHopService_ = trimQuotes(trimString(value));
+                // Quote a list of them, since SQLite splits arguments on commas.
+                nextHopServices_ = splitList(value);
 
+            } else if (key == "wire_format") {
+                wireFormat_ = parseWireFormat(value);
             } else if (key == "batch_size") {
                 batchSize_ = std::stoi(value);
+            } else if (key == "drain_batch_size") {
+                drainBatchSize_ = std::max(1, std::stoi(value));
             } else if (key == "window_size_ms") {
                 windowSizeMs_ = milliseconds(std::stoi(value));
             } else if (key == "max_buffered_rows") {
                 maxBufferedRows = std::stoi(value);
             } else if (key == "max_buffered_bytes") {
-                maxBufferedBytes = std::stoi(value);
+                maxBufferedBytes = std::stoull(value);
             } else if (key == "max_buffered_age_ms") {
                 maxBufferedAge = milliseconds(std::stoi(value));
+            } else if (key == "overflow_policy") {
+                overflowPolicy = parseOverflowPolicy(value);
+            } else if (key == "spill_dir") {
+                spill.dir = trimQuotes(trimString(value));
+            } else if (key == "spill_threshold_bytes") {
+                spill.memoryBytes = std::stoull(value);
+            } else if (key == "max_spilled_bytes") {
+                spill.maxBytes = std::stoull(value);
+            } else if (key == "dict") {
+                internedColumns = splitList(value);
+            } else if (key == "index") {
+                indexedColumns = splitList(value);
+            } else if (key == "compress_blocks") {
+                compressBlocks = std::stoi(value) != 0;
+            } else if (key == "send_batch_rows") {
+                sendBatchRows_ = std::max(1, std::stoi(value));
+            } else if (key == "send_batch_bytes") {
+                sendBatchBytes_ = std::stoull(value);
+            } else if (key == "send_linger_ms") {
+                sendLinger_ = milliseconds(std::stoi(value));
+            } else if (key == "partition_by") {
+                partitionBy = value;
+            } else if (key == "listen") {
+                // Any zmq endpoints, quoted since SQLite splits arguments on commas.
+                listenEndpoints_ = splitList(value);
+            } else if (key == "shared_context") {
+                sharedContext = std::stoi(value) != 0;
             }
         }
 
-        rows_.reset(new RowBuffer(maxBufferedRows, maxBufferedBytes, maxBufferedAge));
+        vector<ColumnType> columnTypes;
+        for (const auto& col : columns_) {
+            columnTypes.push_back(col.type);
+        }
+        textParser_ = TextRowParser(columnTypes);
+
+        auto layout = std::make_shared<ColumnarLayout>(columns_);
+        for (const auto& name : internedColumns) {
+            layout->internColumn(findColumn(name));
+        }
+        for (const auto& name : indexedColumns) {
+            layout->indexColumn(findColumn(name));
+        }
+        layout_ = layout;
+        if (!partitionBy.empty()) {
+            partitionColumn_ = findColumn(partitionBy);
+        }
+        rows_.reset(new ColumnarRowBuffer(maxBufferedRows, maxBufferedBytes, maxBufferedAge,
+                                          layout_, overflowPolicy, spill,
+                                          compressBlocks));
+
+        if (listenPort_ > 0) {
+            auto connStr = Sqlite3Ptr<char>(sqlite3_mprintf("tcp://*:%d", listenPort_));
+            listenEndpoints_.insert(listenEndpoints_.begin(), connStr.get());
+        }
 
         // If the table doesn't listen, and doesn't connect, then what good is it?
-        if (listenPort_ <= 0 && nextHopService_.empty()) {
+        if (listenEndpoints_.empty() && nextHopServices_.empty()) {
             throw std::invalid_argument("Table does not listen and/or connect to anything.");
         }
 
@@ -171,49 +322,108 @@ public:
             throw std::runtime_error("failed to initialize vtab object");
         }
 
-        if ((zctx_ = zmq_ctx_new()) == nullptr) {
+        // Tables sharing a context share its I/O threads, and can reach
+        // each other over inproc:// endpoints.
+        if (sharedContext) {
+            zctx_ = registry_->zmqContext();
+        } else if ((zctx_ = zmq_ctx_new()) == nullptr) {
             throw std::runtime_error(zmq_strerror(zmq_errno()));
+        } else {
+            ownsContext_ = true;
         }
 
-
-        // Wire up the down-stream service, if specified.
-        if (!nextHopService_.empty()) {
-            if ((writeSock_ = zmq_socket(zctx_, ZMQ_PUSH)) == nullptr) {
-                throw std::runtime_error(zmq_strerror(zmq_errno()));
+        // A socket left open by a failed setup would hang zmq_ctx_term(),
+        // which for a shared context runs when the registry goes away.
+        try {
+            // Wire up the down-stream services, if specified.
+            size_t hopCount = partitionColumn_ >= 0 ? nextHopServices_.size() : std::min<size_t>(1, nextHopServices_.size());
+            for (size_t i=0; i < hopCount; i++) {
+                NextHop hop{nullptr, {}, {}, 0};
+                if ((hop.sock = zmq_socket(zctx_, ZMQ_PUSH)) == nullptr) {
+                    throw std::runtime_error(zmq_strerror(zmq_errno()));
+                }
+                nextHops_.push_back(hop);
+                // Ignore failure of this for now..
+                zmq_setsockopt(hop.sock, ZMQ_LINGER, &lingerMs_, sizeof(lingerMs_));
             }
-            std::cout << "Going to connect to: " << nextHopService_ << "\n";
-            if (zmq_connect(writeSock_, nextHopService_.c_str()) == -1) {
-                throw std::runtime_error(zmq_strerror(zmq_errno()));
+            for (size_t i=0; i < nextHopServices_.size(); i++) {
+                void* sock = nextHops_[partitionColumn_ >= 0 ? i : 0].sock;
+                std::cout << "Going to connect to: " << nextHopServices_[i] << "\n";
+                if (zmq_connect(sock, nextHopServices_[i].c_str()) == -1) {
+                    throw std::runtime_error(zmq_strerror(zmq_errno()));
+                }
             }
-            // Ignore failure of this for now..
-            zmq_setsockopt(writeSock_, ZMQ_LINGER, &lingerMs_, sizeof(lingerMs_));
-        }
 
-        // Wire up this service, if specified.
-        if (listenPort_ > 0) {
-            if ((readSock_ = zmq_socket(zctx_, ZMQ_PULL)) == nullptr) {
-                throw std::runtime_error(zmq_strerror(zmq_errno()));
-            }
+            // Wire up this service, if specified. One socket fair-queues
+            // between all of its endpoints.
+            if (forRead()) {
+                if ((readSock_ = zmq_socket(zctx_, ZMQ_PULL)) == nullptr) {
+                    throw std::runtime_error(zmq_strerror(zmq_errno()));
+                }
 
-            auto connStr = Sqlite3Ptr<char>(sqlite3_mprintf("tcp://*:%d", listenPort_));
-            std::cout << "Going to bind to: " << connStr.get() << "\n";
-            if (zmq_bind(readSock_, connStr.get()) == -1) {
-                throw std::runtime_error(zmq_strerror(zmq_errno()));
+                for (const auto& endpoint : listenEndpoints_) {
+                    std::cout << "Going to bind to: " << endpoint << "\n";
+                    if (zmq_bind(readSock_, endpoint.c_str()) == -1) {
+                        throw std::runtime_error(zmq_strerror(zmq_errno()));
+                    }
+                }
+
+                // Ignore failure of this for now..
+                zmq_setsockopt(readSock_, ZMQ_LINGER, &lingerMs_, sizeof(lingerMs_));
+
+                auto stopStr = Sqlite3Ptr<char>(sqlite3_mprintf("inproc://setab-stop-%p", this));
+                if ((stopRecv_ = zmq_socket(zctx_, ZMQ_PAIR)) == nullptr ||
+                    zmq_bind(stopRecv_, stopStr.get()) == -1 ||
+                    (stopSend_ = zmq_socket(zctx_, ZMQ_PAIR)) == nullptr ||
+                    zmq_connect(stopSend_, stopStr.get()) == -1) {
+                    throw std::runtime_error(zmq_strerror(zmq_errno()));
+                }
+                int noLinger = 0;
+                zmq_setsockopt(stopSend_, ZMQ_LINGER, &noLinger, sizeof(noLinger));
             }
+        } catch (...) {
+            closeSockets();
+            throw;
+        }
 
-            // Ignore failure of this for now..
-            zmq_setsockopt(readSock_, ZMQ_LINGER, &lingerMs_, sizeof(lingerMs_));
+        if (forRead()) {
+            ingestThread_ = std::thread([this]() { ingestLoop(); });
+        }
+        if (forWrite() && sendBatchRows_ > 1) {
+            flushThread_ = std::thread([this]() { flushLoop(); });
         }
-        registry_->addTable(tableName_, this);
     }
 
     ~Setab() {
-        zmq_ctx_term(zctx_);
+        stopping_ = true;
+        flushWake_.notify_all();
+        if (flushThread_.joinable()) {
+            flushThread_.join();
+        }
+        // Whatever's left goes out before the context shuts down, or not
+        // at all if the next hop isn't taking it.
+        {
+            std::lock_guard<std::mutex> guard(writeLock_);
+            flushLocked(ZMQ_DONTWAIT);
+        }
+        // Kick the ingest thread out of its wait so that it can close its
+        // sockets and exit. It may have left already, over backpressure.
+        if (ingestThread_.joinable()) {
+            zmq_send(stopSend_, "", 0, ZMQ_DONTWAIT);
+            ingestThread_.join();
+        }
+        if (stopSend_ != nullptr) {
+            zmq_close(stopSend_);
+        }
+        for (auto& hop : nextHops_) {
+            zmq_close(hop.sock);
+        }
+        if (ownsContext_) {
+            zmq_ctx_term(zctx_);
+        }
         registry_->removeTable(tableName_);
     }
 
-    sqlite3_vtab* vTableBase() { return &vTableBase_; }
-
     const vector<Column>& tableColumns() const { return columns_; }
 
     string tableSchema() const {
@@ -231,65 +441,196 @@ public:
         tableName_ = tableName;
     }
 
-    bool parse(ZmqMsg&& m, vector<ColumnValue>& columns) {
-        folly::StringPiece rowData{static_cast<const char*>(m.data()), m.size()};
-        std::cout << "Raw message:`" << folly::cEscape<string>(rowData) << "`\n";
+    // Parses a row into column views that point into `rowData`.
+    bool parse(folly::StringPiece rowData, vector<ColumnView>& columns) {
+        if (wireFormat_ == WireFormat::BINARY) {
+            if (!wire::decodeRow(rowData, columns_, columns)) {
+                std::cout << "Invalid message. Binary row does not match the table schema.\n";
+                return false;
+            }
+            return true;
+        }
+
+        auto status = textParser_.parse(rowData, columns);
+        if (status != ParseStatus::OK) {
+            std::cout << parseStatusMessage(status) << "\n";
+            return false;
+        }
 
-        vector<folly::StringPiece> rawColumns;
-        folly::split(ColSep, rowData, rawColumns);
+        return true;
+    }
 
-        if (rawColumns.size() != columns_.size()) {
-            std::cout << "Message has wrong column count. "
-                      << rawColumns.size() << " != " << columns_.size() << "\n";
+    ColumnarRowCursor getCursor() const {
+        return rows_->getCursor();
+    }
+
+    ColumnarRowCursor getCursor(milliseconds minTime) const {
+        return rows_->getCursor(minTime);
+    }
+
+    size_t writeSequence() const {
+        return rows_->writeSequence();
+    }
+
+    // Blocks until a row newer than `seq` lands in the buffer, or for
+    // maxWait at most. Returns false if it gave up.
+    bool waitForWrite(size_t seq, milliseconds maxWait=0ms) {
+        return rows_->waitForWrite(seq, maxWait);
+    }
+
+    milliseconds windowSize() const { return windowSizeMs_; }
+
+    // Reads rows from the underlying stream.
+    // Waits for one message, then drains whatever else is already queued
+    // (up to drain_batch_size messages) and appends the rows that parse
+    // to the buffer in one go. Bad messages are dropped.
+    // Returns false once the table is going away.
+    bool backendRead() {
+        vector<Row> batch;
+        bool live = true;
+
+        zmq_pollitem_t items[] = {
+            {readSock_, 0, ZMQ_POLLIN, 0},
+            {stopRecv_, 0, ZMQ_POLLIN, 0},
+        };
+        if (zmq_poll(items, 2, -1) == -1) {
+            return zmq_errno() != ETERM;
+        }
+        if (items[1].revents & ZMQ_POLLIN) {
             return false;
         }
 
-        for (size_t i=0; i < columns_.size(); i++) {
-            ColumnValue v;
-            switch (columns_[i].type) {
-                case ColumnType::INTEGER:
-                    try {
-                        v = std::make_tuple(ColumnType::INTEGER, string{}, folly::to<int64_t>(rawColumns[i]));
-                    } catch (const std::range_error& ex) {
-                        std::cout << "Invalid message. Expected INTEGER, got TEXT.\n";
-                        return false;
-                    }
-                    break;
-                case ColumnType::TEXT:
-                    v = std::make_tuple(ColumnType::TEXT, rawColumns[i].str(), -1);
+        for (size_t received = 0; received < drainBatchSize_; received++) {
+            // Rows share ownership of the message their TEXT columns point into.
+            auto m = std::make_shared<ZmqMsg>();
+            if (zmq_msg_recv((zmq_msg_t*)*m, readSock_, ZMQ_DONTWAIT) == -1) {
+                if (zmq_errno() == ETERM) {
+                    live = false;
+                } else if (zmq_errno() != EAGAIN) {
+                    std::cout << "ZMQ error(" << zmq_errno() << "): " << zmq_strerror(zmq_errno()) << "\n";
+                }
+                break;
+            }
+            if (zmq_msg_more((zmq_msg_t*)*m)) {
+                // Several rows to a message. See WireFormat.h.
+                auto rows = std::make_shared<ZmqMsg>();
+                if (zmq_msg_recv((zmq_msg_t*)*rows, readSock_, 0) == -1) {
+                    live = zmq_errno() != ETERM;
                     break;
-                default:
-                    std::cout << "UNKNOWN COLUMN TYPE: " << static_cast<int>(columns_[i].type) << "\n";
-                    return false;
+                }
+                vector<folly::StringPiece> rowData;
+                if (!wire::splitRows(messageData(*m), messageData(*rows), rowData)) {
+                    std::cout << "Invalid message. Row lengths don't match the rows.\n";
+                    continue;
+                }
+                for (auto data : rowData) {
+                    vector<ColumnView> columns;
+                    if (!parse(data, columns)) {
+                        continue;
+                    }
+                    currentRowId_++;
+                    batch.emplace_back(currentRowId_, rows, move(columns));
+                }
+                continue;
             }
 
-            columns.push_back(v);
+            vector<ColumnView> columns;
+            if (!parse(messageData(*m), columns)) {
+                continue;
+            }
+            currentRowId_++;
+            batch.emplace_back(currentRowId_, move(m), move(columns));
         }
 
-        return true;
+        noteIngest(batch.size());
+
+        // With overflow_policy=backpressure a full buffer hands the rows back.
+        // Not reading in the meantime lets the socket's high water mark push
+        // back on senders, until cursors let go of old blocks.
+        while (!rows_->appendRows(batch) && !batch.empty()) {
+            if (stopping_) {
+                return false;
+            }
+            std::this_thread::sleep_for(BackpressureWait);
+        }
+        if (!batch.empty()) {
+            registry_->notifyIngest();
+        }
+        return live;
     }
 
-    RowCursor getCursor() const {
-        return rows_->getCursor();
+    // Folds rows just received into the ingest rate, a moving average over
+    // RateInterval long samples.
+    void noteIngest(size_t rows) {
+        if (rows == 0) {
+            return;
+        }
+        auto now = nowMs();
+        lastIngestMs_.store(now.count(), std::memory_order_relaxed);
+        rateRows_ += rows;
+        auto elapsed = now - rateMark_;
+        if (elapsed < RateInterval) {
+            return;
+        }
+        double sample = rateRows_ * 1000.0 / elapsed.count();
+        double rate = ingestRate_.load(std::memory_order_relaxed);
+        ingestRate_.store(rate == 0.0 ? sample : 0.75 * rate + 0.25 * sample, std::memory_order_relaxed);
+        rateRows_ = 0;
+        rateMark_ = now;
     }
 
-    // Reads a row from the underlying stream.
-    // Inserts row into the buffer if successful, otherwise does nothing.
-    void backendRead() {
-        ZmqMsg m;
-        vector<ColumnValue> columns;
+    // The ingest rate, or 0 once the stream has gone quiet.
+    double ingestRate() const {
+        auto quiet = nowMs() - milliseconds(lastIngestMs_.load(std::memory_order_relaxed));
+        return quiet > 10 * RateInterval ? 0.0 : ingestRate_.load(std::memory_order_relaxed);
+    }
 
-        if (zmq_msg_recv((zmq_msg_t*)m, readSock_, 0 /* wait */) == -1) {
-            std::cout << "ZMQ error(" << zmq_errno() << "): " << zmq_strerror(zmq_errno()) << "\n";
-            return;
+    static folly::StringPiece messageData(const ZmqMsg& m) {
+        return folly::StringPiece(static_cast<const char*>(m.data()), m.size());
+    }
+
+    // Body of the ingest thread. Keeps the network side of the table
+    // moving whether or not a query is currently stepping a cursor.
+    void ingestLoop() {
+        while (backendRead()) {}
+        zmq_close(readSock_);
+        zmq_close(stopRecv_);
+    }
+
+    ColumnType columnType(size_t column) const { return columns_[column].type; }
+
+    // How a constraint is written in idxStr, if it can use zone maps.
+    static const char* zoneOperator(unsigned char op) {
+        switch (op) {
+            case SQLITE_INDEX_CONSTRAINT_EQ: return "=";
+            case SQLITE_INDEX_CONSTRAINT_LT: return "<";
+            case SQLITE_INDEX_CONSTRAINT_LE: return "<=";
+            case SQLITE_INDEX_CONSTRAINT_GT: return ">";
+            case SQLITE_INDEX_CONSTRAINT_GE: return ">=";
         }
+        return nullptr;
+    }
 
-        if (!parse(move(m), columns)) {
-            return;
+    // Splits a table arg that lists several values. The list has to be
+    // quoted, or SQLite would split it into separate args at the commas.
+    static vector<string> splitList(const string& value) {
+        vector<string> items;
+        folly::split(',', trimQuotes(trimString(value)), items, true);
+        for (auto& item : items) {
+            item = trimString(item);
         }
+        return items;
+    }
 
-        currentRowId_++;
-        rows_->appendRow(Row(currentRowId_, move(columns)));
+    // Where a column named in the table args is in the schema.
+    size_t findColumn(const string& name) const {
+        auto column = trimString(name);
+        auto found = std::find_if(columns_.begin(), columns_.end(),
+                                  [&column](const Column& col) { return col.name == column; });
+        if (found == columns_.end()) {
+            throw std::invalid_argument("Unknown column: " + column);
+        }
+        return found - columns_.begin();
     }
 
     bool batchConsumed(int64_t rowId, int64_t batchStart, milliseconds cursorOpenedMs) {
@@ -304,35 +645,166 @@ public:
 
     static constexpr int TS_COLUMN = 0;
 
+    // How long the ingest thread waits before retrying a full buffer.
+    static constexpr milliseconds BackpressureWait = 1ms;
+
+    // How long an idle flush thread sleeps before checking whether the table
+    // is going away, since the destructor doesn't take the lock to tell it.
+    static constexpr milliseconds FlushIdleWait = 100ms;
+
+    // How often the ingest rate is sampled.
+    static constexpr milliseconds RateInterval = 1000ms;
+
+    // What bestIndex() charges for each second a scan may sit waiting on
+    // the stream. It's a lot, so that SQLite puts streams on the outside of
+    // joins rather than waiting on them once per outer row.
+    static constexpr double WaitCostPerSecond = 1.0e6;
+
     /**
      * The idxNum set in the output section of sqlite3_index_info is a bitmap to describe usage.
      * 0 - ts column (gt constraint)
      * 1 - ts column (ge constraint)
+     * 2 - ts column (lt constraint)
+     * 3 - ts column (le constraint)
+     * 4 - ts column (eq constraint), passed once as both the ge and le bounds
+     * 5 - eq constraint on an indexed column, whose number is in the bits from 8 up
+     * 6 - rowid (eq constraint), which is then the only constraint used
+     * The lower bound, if any, is passed first in argv, then the upper bound,
+     * then the indexed value.
+     *
+     * Constraints on other INTEGER columns are checked against each block's
+     * zone maps. idxStr lists them as `column op` terms separated by ';',
+     * with op one of = < <= > >=, and their values follow in argv.
      */
+    static constexpr int TS_GT = 1;
+    static constexpr int TS_GE = 2;
+    static constexpr int TS_LT = 4;
+    static constexpr int TS_LE = 8;
+    static constexpr int TS_EQ = 16;
+    static constexpr int INDEX_EQ = 32;
+    static constexpr int ROWID_EQ = 64;
+    static constexpr int INDEX_COLUMN_SHIFT = 8;
+
     void bestIndex(sqlite3_index_info* pIndexInfo) {
         using index_constraint = typename sqlite3_index_info::sqlite3_index_constraint;
-        double estimatedCost = 1.0e3;
         int nArg = 0;
         int index = 0;
-        int tsIndex = -1;
+        int lowerIndex = -1;
+        int upperIndex = -1;
+        int eqIndex = -1;
+        int lookupIndex = -1;
+        int rowIdIndex = -1;
+        vector<int> zoneIndexes;
         const index_constraint* pConstraint = pIndexInfo->aConstraint;
         for (int i=0; i < pIndexInfo->nConstraint; i++, pConstraint++) {
             if (pConstraint->usable == 0) {
                 continue;
             }
+            if (pConstraint->iColumn < 0 && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+                rowIdIndex = i;
+                continue;
+            }
+            if (pConstraint->iColumn > TS_COLUMN && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+                    lookupIndex < 0 && layout_->indexOf(pConstraint->iColumn) >= 0) {
+                lookupIndex = i;
+                continue;
+            }
+            if (pConstraint->iColumn > TS_COLUMN && columns_[pConstraint->iColumn].type == ColumnType::INTEGER &&
+                    zoneOperator(pConstraint->op) != nullptr) {
+                zoneIndexes.push_back(i);
+                continue;
+            }
             if (pConstraint->iColumn == TS_COLUMN) {
                 if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_GT) {
-                    tsIndex = i;
-                    index |= 1;
+                    lowerIndex = i;
+                    index = (index & ~TS_GE) | TS_GT;
                 } else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_GE) {
-                    tsIndex = i;
-                    index |= 2;
+                    lowerIndex = i;
+                    index = (index & ~TS_GT) | TS_GE;
+                } else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_LT) {
+                    upperIndex = i;
+                    index = (index & ~TS_LE) | TS_LT;
+                } else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_LE) {
+                    upperIndex = i;
+                    index = (index & ~TS_LT) | TS_LE;
+                } else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+                    eqIndex = i;
                 }
-                estimatedCost -= 100.0; /* filtering on ts isn't actually cheaper, but what the hell? */
             }
         }
-        if (tsIndex >= 0) {
-            pIndexInfo->aConstraintUsage[tsIndex].argvIndex = ++nArg;
+
+        // Guess at how many rows a plain scan sees: what's buffered, plus
+        // what arrives before the batch fills or the window closes.
+        double rate = ingestRate();
+        double windowSeconds = windowSizeMs_.count() / 1000.0;
+        double buffered = rows_->totalRows();
+        double available = std::min<double>(batchSize_, buffered + rate * windowSeconds);
+        // The fraction of those that are returned, and that are looked at.
+        double selected = 1.0;
+        double examined = 1.0;
+
+        if (rowIdIndex >= 0) {
+            // At most one row, found among the buffered ones.
+            pIndexInfo->aConstraintUsage[rowIdIndex].argvIndex = ++nArg;
+            pIndexInfo->aConstraintUsage[rowIdIndex].omit = 1;
+            pIndexInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+            pIndexInfo->idxNum = ROWID_EQ;
+            pIndexInfo->estimatedRows = 1;
+            pIndexInfo->estimatedCost = std::max(1.0, buffered / 2);
+            return;
+        }
+        if (eqIndex >= 0) {
+            // A single point in time beats any range.
+            index = TS_EQ | TS_GE | TS_LE;
+            pIndexInfo->aConstraintUsage[eqIndex].argvIndex = ++nArg;
+            // About as many rows as arrive in a millisecond.
+            selected = std::max(1.0, rate / 1000.0) / std::max(1.0, available);
+            examined = selected;
+        } else {
+            if (lowerIndex >= 0) {
+                pIndexInfo->aConstraintUsage[lowerIndex].argvIndex = ++nArg;
+                selected *= 0.25;
+                examined *= 0.25;
+            }
+            if (upperIndex >= 0) {
+                pIndexInfo->aConstraintUsage[upperIndex].argvIndex = ++nArg;
+                // The cursor stops at the first row past the upper bound, so
+                // no row it returns can fail it.
+                pIndexInfo->aConstraintUsage[upperIndex].omit = 1;
+                selected *= 0.25;
+                examined *= 0.25;
+            }
+        }
+        if (lookupIndex >= 0) {
+            // Only matching rows are read, though SQLite still checks them,
+            // since it compares with its own affinity rules.
+            int column = pIndexInfo->aConstraint[lookupIndex].iColumn;
+            index |= INDEX_EQ | (column << INDEX_COLUMN_SHIFT);
+            pIndexInfo->aConstraintUsage[lookupIndex].argvIndex = ++nArg;
+            // An interned column knows how many distinct values it has.
+            double distinct = 10.0;
+            if (layout_->interned(column)) {
+                distinct = std::max<double>(1, layout_->dictionaries[layout_->slots[column]]->size());
+            }
+            selected /= distinct;
+            examined /= distinct;
+        }
+        string zoneTerms;
+        for (int i : zoneIndexes) {
+            const auto& constraint = pIndexInfo->aConstraint[i];
+            if (!zoneTerms.empty()) {
+                zoneTerms += ';';
+            }
+            zoneTerms += to_string(constraint.iColumn) + zoneOperator(constraint.op);
+            pIndexInfo->aConstraintUsage[i].argvIndex = ++nArg;
+            // Skipped blocks save some of the reading, but not all.
+            double fraction = constraint.op == SQLITE_INDEX_CONSTRAINT_EQ ? 0.1 : 0.25;
+            selected *= fraction;
+            examined *= std::sqrt(fraction);
+        }
+        if (!zoneTerms.empty()) {
+            pIndexInfo->idxStr = sqlite3_mprintf("%s", zoneTerms.c_str());
+            pIndexInfo->needToFreeIdxStr = 1;
         }
         if (pIndexInfo->nOrderBy==1) {
             // Time naturally goes forwards, so tell the engine it doesn't need a sort here.
@@ -341,61 +813,286 @@ public:
                 pIndexInfo->orderByConsumed = 1;
             }
         }
+
+        // Unless an upper bound ends it, a scan the buffer can't fill waits
+        // on the stream for the rest of its batch, or its whole window.
+        double waitSeconds = 0.0;
+        if (upperIndex < 0 && buffered < batchSize_) {
+            waitSeconds = rate > 0.0 ? std::min(windowSeconds, (batchSize_ - buffered) / rate) : windowSeconds;
+        }
         pIndexInfo->idxNum = index;
-        pIndexInfo->estimatedCost = estimatedCost;
-        pIndexInfo->estimatedRows = 10; /* TODO: Track cursor creation time, read rate, and last row time to guess at this. */
+        pIndexInfo->estimatedRows = static_cast<sqlite3_int64>(std::max(1.0, available * selected));
+        pIndexInfo->estimatedCost = std::max(1.0, available * examined) + waitSeconds * WaitCostPerSecond;
     }
 
-    bool forWrite() const { return !nextHopService_.empty(); }
-    bool forRead() const { return listenPort_ > 0; }
+    bool forWrite() const { return !nextHopServices_.empty(); }
+    bool forRead() const { return !listenEndpoints_.empty(); }
 
     bool isWriteOnly() const { return forWrite() && !forRead(); }
     bool isReadOnly() const { return  !forWrite() && forRead(); }
 
 
-    int write(sqlite_int64* pRowid, vector<sqlite3_value*> values) {
-        vector<string> strValues;
-        for (auto v : values) {
-            strValues.push_back(string((char*)sqlite3_value_blob(v), sqlite3_value_bytes(v)));
+    void encodeText(const vector<sqlite3_value*>& values, string& out) const {
+        for (size_t i=0; i < values.size(); i++) {
+            if (i > 0) {
+                out.push_back(ColSep);
+            }
+            const char* text = static_cast<const char*>(sqlite3_value_blob(values[i]));
+            if (text != nullptr) {
+                out.append(text, sqlite3_value_bytes(values[i]));
+            }
         }
+    }
+
+    void encodeBinary(const vector<sqlite3_value*>& values, string& out) const {
+        for (size_t i=0; i < values.size() && i < columns_.size(); i++) {
+            if (columns_[i].type == ColumnType::INTEGER) {
+                wire::appendInteger(out, sqlite3_value_int64(values[i]));
+            } else {
+                const char* text = reinterpret_cast<const char*>(sqlite3_value_text(values[i]));
+                wire::appendText(out, folly::StringPiece(text, text + sqlite3_value_bytes(values[i])));
+            }
+        }
+    }
+
+    int write(sqlite_int64* pRowid, vector<sqlite3_value*> values) {
         std::cout << "Performing 'insert' into " << tableName_ << "\n";
-        int i=0;
-        for (auto& v: strValues) {
-            std::cout << "col[" << i << "]:" << v << "\n";
-            i++;
+        if (values.size() != columns_.size()) {
+            return SQLITE_CONSTRAINT_VTAB;
         }
-        ZmqMsg m(joinVector(strValues, string(1, ColSep)));
-        if (zmq_msg_send((zmq_msg_t*)m, writeSock_, 0) == -1) {
-            std::cout << "er, send failed: " << zmq_strerror(zmq_errno()) << "\n";
-            return SQLITE_FULL; // I guess?
+        std::lock_guard<std::mutex> guard(writeLock_);
+        NextHop& hop = nextHops_[partitionOf(values)];
+        size_t rowStart = hop.rows.size();
+        if (wireFormat_ == WireFormat::BINARY) {
+            encodeBinary(values, hop.rows);
+        } else {
+            encodeText(values, hop.rows);
+        }
+        wire::appendLength(hop.lengths, hop.rows.size() - rowStart);
+        hop.count++;
+        if (outCount_++ == 0) {
+            outStarted_ = nowMs();
+            flushWake_.notify_one();
+        }
+        if (hop.count >= sendBatchRows_ || hop.rows.size() >= sendBatchBytes_) {
+            return sendBatch(hop, 0) ? SQLITE_OK : SQLITE_FULL; // I guess?
         }
         return SQLITE_OK;
     }
 
+    // Which of nextHops_ a row goes to. Both ends of the hash are fixed, so
+    // every table partitioning on the same key over the same list of
+    // services sends a given key to the same place.
+    size_t partitionOf(const vector<sqlite3_value*>& values) const {
+        if (nextHops_.size() < 2) {
+            return 0;
+        }
+        sqlite3_value* key = values[partitionColumn_];
+        string bytes;
+        if (columns_[partitionColumn_].type == ColumnType::INTEGER) {
+            wire::appendInteger(bytes, sqlite3_value_int64(key));
+        } else {
+            const char* text = static_cast<const char*>(sqlite3_value_blob(key));
+            bytes.assign(text ? text : "", sqlite3_value_bytes(key));
+        }
+        return codec::TextHash()(bytes) % nextHops_.size();
+    }
+
+    // Sends whatever rows are waiting. SQLite calls this on commit.
+    int flush() {
+        std::lock_guard<std::mutex> guard(writeLock_);
+        return flushLocked(0);
+    }
+
+    // Undoes the constructor's zmq setup when it fails partway.
+    void closeSockets() {
+        for (void* sock : {readSock_, stopRecv_, stopSend_}) {
+            if (sock != nullptr) {
+                zmq_close(sock);
+            }
+        }
+        for (auto& hop : nextHops_) {
+            zmq_close(hop.sock);
+        }
+        nextHops_.clear();
+        if (ownsContext_) {
+            zmq_ctx_term(zctx_);
+        }
+    }
+
+    // Hold writeLock_.
+    int flushLocked(int flags) {
+        bool sent = true;
+        for (auto& hop : nextHops_) {
+            sent = sendBatch(hop, flags) && sent;
+        }
+        return sent ? SQLITE_OK : SQLITE_FULL;
+    }
+
+    // Sends a lone row as a plain message, so batching is invisible to
+    // receivers until there's something to batch. A batch that would have
+    // blocked under ZMQ_DONTWAIT stays put for the next try. Hold writeLock_.
+    bool sendBatch(NextHop& hop, int flags) {
+        if (hop.count == 0) {
+            return true;
+        }
+        bool sent = hop.count == 1
+            ? zmq_send(hop.sock, hop.rows.data(), hop.rows.size(), flags) != -1
+            : zmq_send(hop.sock, hop.lengths.data(), hop.lengths.size(), flags | ZMQ_SNDMORE) != -1 &&
+              zmq_send(hop.sock, hop.rows.data(), hop.rows.size(), flags) != -1;
+        if (!sent && zmq_errno() == EAGAIN) {
+            return false;
+        }
+        if (!sent) {
+            std::cout << "er, send failed: " << zmq_strerror(zmq_errno()) << "\n";
+        }
+        // Keep the buffers' capacity for the next batch.
+        hop.rows.clear();
+        hop.lengths.clear();
+        outCount_ -= hop.count;
+        hop.count = 0;
+        return sent;
+    }
+
+    // Body of the flush thread. Sends a batch once its first row has
+    // waited sendLinger_, in case nothing else comes along to fill it.
+    // It never blocks on a send, since that would hold writeLock_ for as
+    // long as a next hop sat at its high-water mark; a batch that can't go
+    // yet is tried again after another sendLinger_.
+    void flushLoop() {
+        std::unique_lock<std::mutex> guard(writeLock_);
+        while (!stopping_) {
+            if (outCount_ == 0) {
+                flushWake_.wait_for(guard, FlushIdleWait);
+                continue;
+            }
+            auto due = outStarted_ + sendLinger_;
+            auto now = nowMs();
+            if (now >= due) {
+                if (flushLocked(ZMQ_DONTWAIT) != SQLITE_OK) {
+                    outStarted_ = now;
+                }
+                continue;
+            }
+            flushWake_.wait_for(guard, due - now);
+        }
+    }
+
     const string& tableName() const { return tableName_; }
     SetabRegistry* registry() { return registry_; }
 };
 
+class SetabCursor;
+
+// Collects what the setab scans run by one sqlite3_step() on this thread
+// found: whether each still had buffered rows to go, or had caught up with
+// its stream and as of which write sequence. A selection whose scans have
+// caught up only needs stepping again once its streams take in rows, since
+// stepping it before then just waits on them.
+class StreamProbe {
+public:
+    StreamProbe() : previous_{current_} { current_ = this; }
+    ~StreamProbe() { current_ = previous_; }
+
+    StreamProbe(const StreamProbe&) = delete;
+    StreamProbe& operator=(const StreamProbe&) = delete;
+
+    // A scan's latest position wins over what it noted earlier in the step.
+    static void note(const SetabCursor* cursor, const Setab* table, size_t seq, bool caughtUp) {
+        if (current_ != nullptr) {
+            current_->scans_[cursor] = Scan{table, seq, caughtUp};
+        }
+    }
+
+    // Whether a scan of `table` was left with buffered rows to go. If every
+    // scan of it caught up instead, `seq` moves on to the earliest write
+    // sequence one of them caught up at.
+    bool behind(const Setab* table, size_t& seq) const {
+        size_t caughtUpSeq = std::numeric_limits<size_t>::max();
+        for (const auto& entry : scans_) {
+            const Scan& scan = entry.second;
+            if (scan.table != table) {
+                continue;
+            }
+            if (!scan.caughtUp) {
+                return true;
+            }
+            caughtUpSeq = std::min(caughtUpSeq, scan.seq);
+        }
+        if (caughtUpSeq != std::numeric_limits<size_t>::max()) {
+            seq = std::max(seq, caughtUpSeq);
+        }
+        return false;
+    }
+
+private:
+    struct Scan {
+        const Setab* table;
+        size_t seq;
+        bool caughtUp;
+    };
+
+    static thread_local StreamProbe* current_;
+    StreamProbe* previous_;
+    unordered_map<const SetabCursor*, Scan> scans_;
+};
+
 class SetabCursor {
     sqlite3_vtab_cursor vTableCursorBase_;
     Setab* parent_;
     int64_t batchStart_;
     milliseconds cursorOpened_;
 
-    RowCursor cursor_;
-    
+    ColumnarRowCursor cursor_;
+    // Rows arrive in roughly time order, so the scan ends at the first row
+    // past the upper bound.
+    bool hasUpperBound_;
+    milliseconds upperBound_;
+    bool emptyRange_;
+    // An equality filter on an indexed column, which the cursor only stops
+    // on matches of.
+    bool hasLookup_;
+    size_t lookupColumn_;
+    string lookupText_;
+    int64_t lookupInteger_;
+    // Ranges on INTEGER columns, which let the cursor pass over blocks
+    // whose zone maps rule them out.
+    struct ZoneFilter {
+        size_t column;
+        int64_t low;
+        int64_t high;
+    };
+    vector<ZoneFilter> zoneFilters_;
+    // Set for a rowid lookup, which returns one row at most.
+    bool onlyRow_;
+    // Set when the window ran out while waiting on the stream.
+    bool windowClosed_;
+
 public:
     SetabCursor(Setab* parent)
         : vTableCursorBase_{},
           parent_{parent},
           batchStart_{-1},
           cursorOpened_{nowMs()},
-          cursor_(parent->getCursor()) {
+          cursor_(parent->getCursor()),
+          hasUpperBound_{false},
+          upperBound_{0},
+          emptyRange_{false},
+          hasLookup_{false},
+          lookupColumn_{0},
+          lookupText_{},
+          lookupInteger_{0},
+          zoneFilters_{},
+          onlyRow_{false},
+          windowClosed_{false} {
     }
 
     sqlite3_vtab_cursor* vTableCursorBase() { return &vTableCursorBase_; }
 
     bool isEOF() {
+        if (windowClosed_ || emptyRange_ || (hasUpperBound_ && row().ts() > upperBound_)) {
+            return true;
+        }
         return parent_->batchConsumed(rowId(), batchStart_, cursorOpened_);
     }
 
@@ -403,9 +1100,25 @@ public:
         return row().rowId();
     }
 
+    // Lets a StreamProbe know where the scan stands. See StreamProbe.
+    void noteProgress() const {
+        size_t seq = parent_->writeSequence();
+        StreamProbe::note(this, parent_, seq, cursor_.atEnd());
+    }
+
+    // Jumps straight to the first buffered row that's new enough, and only
+    // falls back to waiting on the stream when there isn't one yet.
     int64_t seekUntilTime(milliseconds epoch, int seekType) {
+        milliseconds minTime = seekType == SQLITE_INDEX_CONSTRAINT_GT ? epoch + 1ms : epoch;
+        cursor_ = parent_->getCursor(minTime);
+        if (row().valid() && row().ts() >= minTime) {
+            return rowId();
+        }
         while (true) {
             int64_t batchStart = nextRow();
+            if (windowClosed_) {
+                return batchStart;
+            }
             if (seekType == SQLITE_INDEX_CONSTRAINT_GE) {
                 if (row().ts() >= epoch) {
                     return batchStart;
@@ -420,33 +1133,235 @@ public:
     }
     
     int64_t nextRow() {
-        while (!cursor_.next()) {
-            parent_->backendRead(); /* poll the stream */
+        if (onlyRow_) {
+            emptyRange_ = true;
+            return rowId();
+        }
+        while (true) {
+            size_t seq = parent_->writeSequence();
+            if (cursor_.next()) {
+                break;
+            }
+            if (!waitForRows(seq)) { /* the ingest thread will wake us */
+                return rowId();
+            }
         }
+        skipToMatch();
         return rowId();
     }
 
-    int filter(int idxNum, std::vector<sqlite3_value*> values) {
+    // Finds the row with the given rowid, if it's still buffered. Rowids
+    // only go up, so the walk stops at the first one that's as large.
+    int findRowId(int64_t target) {
+        cursor_ = parent_->getCursor();
+        while (row().valid() && rowId() < target && cursor_.next()) {}
+        emptyRange_ = !row().valid() || rowId() != target;
+        batchStart_ = rowId();
+        return SQLITE_OK;
+    }
+
+    // With an index lookup, moves on to the first matching row from here,
+    // waiting for one if need be. It stops early on a row past the upper
+    // bound, since that's the end of the scan anyway.
+    void skipToMatch() {
+        if (!hasLookup_ && zoneFilters_.empty()) {
+            return;
+        }
+        ColumnView value = parent_->columnType(lookupColumn_) == ColumnType::INTEGER
+            ? ColumnView(ColumnType::INTEGER, folly::StringPiece(), lookupInteger_)
+            : ColumnView(ColumnType::TEXT, lookupText_, -1);
+        while (true) {
+            size_t seq = parent_->writeSequence();
+            if (advanceToMatch(value)) {
+                return;
+            }
+            if (hasUpperBound_ && row().valid() && row().ts() > upperBound_) {
+                return;
+            }
+            if (!waitForRows(seq)) {
+                return;
+            }
+        }
+    }
+
+    // Waits for a row newer than `seq`, but no longer than what's left of
+    // the window. The batch ends with the window whether or not the stream
+    // has anything more, so an idle stream doesn't hold up the query.
+    bool waitForRows(size_t seq) {
+        auto remaining = parent_->windowSize() - (nowMs() - cursorOpened_);
+        if (remaining <= 0ms || !parent_->waitForWrite(seq, remaining)) {
+            windowClosed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Moves on until a row passes every filter. Each one only ever moves
+    // the cursor forward, so a row none of them moves off passes them all.
+    bool advanceToMatch(const ColumnView& value) {
+        while (true) {
+            int64_t start = rowId();
+            if (hasLookup_ && !cursor_.findNext(lookupColumn_, value)) {
+                return false;
+            }
+            for (const auto& filter : zoneFilters_) {
+                if (!cursor_.findInRange(filter.column, filter.low, filter.high)) {
+                    return false;
+                }
+            }
+            if (rowId() == start) {
+                return true;
+            }
+        }
+    }
+
+    // Reads a bound on ts as the inclusive whole millisecond it comes to,
+    // and returns false if no row can pass it. bestIndex() omits the upper
+    // bound, so this has to be exact. Computed bounds are often REAL, and
+    // since ts is whole, a fractional one rounds inward whether or not it's
+    // strict: ts < 1000.5 is ts <= 1000. SQLite ranks NULL against nothing
+    // and text above every number.
+    static bool tsBound(sqlite3_value* value, bool lower, bool strict, int64_t& bound) {
+        constexpr int64_t Lowest = std::numeric_limits<int64_t>::min();
+        constexpr int64_t Highest = std::numeric_limits<int64_t>::max();
+        switch (sqlite3_value_numeric_type(value)) {
+            case SQLITE_INTEGER:
+                bound = sqlite3_value_int64(value);
+                if (strict) {
+                    if (bound == (lower ? Highest : Lowest)) {
+                        return false;
+                    }
+                    bound += lower ? 1 : -1;
+                }
+                return true;
+            case SQLITE_FLOAT: {
+                double exact = sqlite3_value_double(value);
+                double whole = lower ? std::ceil(exact) : std::floor(exact);
+                if (strict && whole == exact) {
+                    whole += lower ? 1 : -1;
+                }
+                if (whole >= static_cast<double>(Highest)) {
+                    bound = Highest;
+                } else if (whole <= static_cast<double>(Lowest)) {
+                    bound = Lowest;
+                } else {
+                    bound = static_cast<int64_t>(whole);
+                }
+                return true;
+            }
+            case SQLITE_NULL:
+                return false;
+            default:
+                bound = Highest;
+                return !lower;
+        }
+    }
+
+    // Reads the zone map terms bestIndex() wrote into idxStr. Only exact
+    // integers are pushed down; SQLite still checks every constraint, so
+    // leaving one out only costs a scan.
+    void parseZoneFilters(const char* idxStr, const vector<sqlite3_value*>& values, size_t arg) {
+        if (idxStr == nullptr) {
+            return;
+        }
+        vector<string> terms;
+        folly::split(';', idxStr, terms, true);
+        for (const auto& term : terms) {
+            auto opPos = term.find_first_of("=<>");
+            size_t column = std::stoul(term.substr(0, opPos));
+            auto op = term.substr(opPos);
+            sqlite3_value* value = values[arg++];
+            if (sqlite3_value_type(value) != SQLITE_INTEGER) {
+                continue;
+            }
+            int64_t x = sqlite3_value_int64(value);
+            ZoneFilter filter{column, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+            if (op == "=" || op == ">=") {
+                filter.low = x;
+            }
+            if (op == "=" || op == "<=") {
+                filter.high = x;
+            }
+            if (op == ">") {
+                if (x == std::numeric_limits<int64_t>::max()) {
+                    emptyRange_ = true;
+                    return;
+                }
+                filter.low = x + 1;
+            }
+            if (op == "<") {
+                if (x == std::numeric_limits<int64_t>::min()) {
+                    emptyRange_ = true;
+                    return;
+                }
+                filter.high = x - 1;
+            }
+            zoneFilters_.push_back(filter);
+        }
+    }
+
+    int filter(int idxNum, const char* idxStr, std::vector<sqlite3_value*> values) {
         cursorOpened_ = nowMs();
         //std::cout << "filter() argv size:" << values.size() << "\n";
-        if (idxNum == 0) {
-            batchStart_ = nextRow();
-            return SQLITE_OK;
+        hasUpperBound_ = false;
+        emptyRange_ = false;
+        windowClosed_ = false;
+        hasLookup_ = false;
+        zoneFilters_.clear();
+        onlyRow_ = (idxNum & Setab::ROWID_EQ) != 0;
+        if (onlyRow_) {
+            return findRowId(sqlite3_value_int64(values[0]));
         }
-        milliseconds startTime = milliseconds(sqlite3_value_int64(values[0]));
+        size_t arg = 0;
         int seekType = -1;
-        if (idxNum & 1) {
-            seekType = SQLITE_INDEX_CONSTRAINT_GT;
-            std::cout << "Filtering on tsGT:" << startTime.count() << "\n";
-        } else if (idxNum & 2) {
+        milliseconds startTime{0};
+        // Both bounds become inclusive, whichever they started as.
+        if (idxNum & (Setab::TS_GT | Setab::TS_GE)) {
+            int64_t lowest = 0;
+            if (!tsBound(values[arg], true, (idxNum & Setab::TS_GT) != 0, lowest)) {
+                emptyRange_ = true;
+            }
+            startTime = milliseconds(lowest);
+            if (!(idxNum & Setab::TS_EQ)) {
+                arg++;
+            }
             seekType = SQLITE_INDEX_CONSTRAINT_GE;
             std::cout << "Filtering on tsGE:" << startTime.count() << "\n";
         }
+        hasUpperBound_ = (idxNum & (Setab::TS_LT | Setab::TS_LE)) != 0;
+        if (hasUpperBound_) {
+            int64_t highest = 0;
+            if (!tsBound(values[arg++], false, (idxNum & Setab::TS_LT) != 0, highest)) {
+                emptyRange_ = true;
+            }
+            upperBound_ = milliseconds(highest);
+            if (seekType != -1 && startTime > upperBound_) {
+                // Nothing can match, so don't wait around for it.
+                emptyRange_ = true;
+            }
+        }
+        hasLookup_ = (idxNum & Setab::INDEX_EQ) != 0;
+        if (hasLookup_) {
+            lookupColumn_ = idxNum >> Setab::INDEX_COLUMN_SHIFT;
+            lookupInteger_ = sqlite3_value_int64(values[arg]);
+            const char* text = reinterpret_cast<const char*>(sqlite3_value_text(values[arg]));
+            lookupText_ = text ? string(text, sqlite3_value_bytes(values[arg])) : string();
+            arg++;
+        }
+        parseZoneFilters(idxStr, values, arg);
+        if (emptyRange_) {
+            return SQLITE_OK;
+        }
+        if (seekType == -1) {
+            batchStart_ = nextRow();
+            return SQLITE_OK;
+        }
         batchStart_ = seekUntilTime(startTime, seekType);
+        skipToMatch();
         return SQLITE_OK;
     }
 
-    const Row& row() const { return cursor_.get(); }
+    ColumnarRowCursor::RowRef row() const { return cursor_.get(); }
 };
 
 sqlite3_module* Sqlite3SetabModule();
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "setab/SpillSegment.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+string errorString(const string& what, const string& path, int err) {
+    return what + " " + path + ": " + std::strerror(err);
+}
+}
+
+std::shared_ptr<SpillSegment> SpillSegment::create(const string& dir, size_t capacity) {
+    static std::atomic<uint64_t> segmentCount{0};
+    string path = dir + "/setab-" + to_string(::getpid()) + "-" + to_string(segmentCount++) + ".seg";
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        throw std::runtime_error(errorString("Failed to create spill segment", path, errno));
+    }
+    ::unlink(path.c_str());
+
+    int err = ::posix_fallocate(fd, 0, capacity);
+    if (err != 0) {
+        ::close(fd);
+        throw std::runtime_error(errorString("Failed to reserve spill segment", path, err));
+    }
+    void* base = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        err = errno;
+        ::close(fd);
+        throw std::runtime_error(errorString("Failed to map spill segment", path, err));
+    }
+    return std::shared_ptr<SpillSegment>(new SpillSegment(fd, static_cast<char*>(base), capacity));
+}
+
+SpillSegment::~SpillSegment() {
+    ::munmap(base_, capacity_);
+    ::close(fd_);
+}
+
+char* SpillSegment::append(const void* data, size_t bytes) {
+    size_t size = alignedSize(bytes);
+    if (size > remaining()) {
+        throw std::length_error("Spill segment is full.");
+    }
+    char* dest = base_ + used_;
+    std::memcpy(dest, data, bytes);
+    used_ += size;
+    return dest;
+}
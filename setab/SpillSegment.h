@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#pragma once
+
+#include "setab/Util.h"
+
+// An append-only scratch file, mapped into memory, that sealed row blocks
+// are copied into when a buffer spills to disk. Blocks read their data
+// straight out of the mapping, so the kernel pages it in and out as needed.
+//
+// The file is removed as soon as it's created, so nothing is left behind
+// if the process dies; it goes away for good once the segment is destroyed.
+// Blocks hold a shared_ptr to their segment for as long as they need it.
+class SpillSegment {
+public:
+    // Reserves `capacity` bytes on disk in a new file under `dir`, so that a
+    // full disk is an exception here rather than a SIGBUS later on.
+    static std::shared_ptr<SpillSegment> create(const string& dir, size_t capacity);
+
+    SpillSegment(const SpillSegment&) = delete;
+    SpillSegment& operator=(const SpillSegment&) = delete;
+
+    ~SpillSegment();
+
+    // Copies `bytes` into the segment, at an 8 byte aligned offset, and
+    // returns where they landed. Throws if they don't fit.
+    char* append(const void* data, size_t bytes);
+
+    // How many bytes append() would use for `bytes`.
+    static size_t alignedSize(size_t bytes) {
+        return (bytes + 7) & ~size_t{7};
+    }
+
+    size_t capacity() const { return capacity_; }
+    size_t remaining() const { return capacity_ - used_; }
+
+private:
+    SpillSegment(int fd, char* base, size_t capacity)
+        : fd_{fd}, base_{base}, capacity_{capacity}, used_{0} {}
+
+    int fd_;
+    char* base_;
+    size_t capacity_;
+    size_t used_;
+};
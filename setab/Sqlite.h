@@ -149,6 +149,13 @@ public:
         }
     }
 
+    // For URIs and such. See sqlite3_open_v2() for the flags.
+    void open(const std::string& path, int flags) {
+        if (sqlite3_open_v2(path.c_str(), &db_, flags, nullptr) != SQLITE_OK) {
+            throw Sqlite3Exception(sqlite3_errmsg(db_));
+        }
+    }
+
     // Called automatically on destruction.
     void close() {
         sqlite3_close(db_);
@@ -162,7 +169,11 @@ public:
         }
         ~TransactionProxy() {
             if (!finished) {
-                rollback();
+                // Nothing to be done about a failed rollback, and destructors
+                // mustn't throw.
+                try {
+                    rollback();
+                } catch (const Sqlite3Exception&) {}
             }
         }
 
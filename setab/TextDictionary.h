@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#pragma once
+
+#include "setab/BlockCodec.h"
+#include "setab/Util.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+
+#include <folly/Range.h>
+
+// Interns the values of a low-cardinality TEXT column, so that blocks store
+// a 32-bit code per row in place of the text. Codes are handed out in order
+// and never reused, and the text behind a code never moves, so a lookup()
+// stays valid for as long as the dictionary does.
+//
+// Only the table's writer calls intern(). Readers only look up codes they
+// found in a published row, and publishing the row publishes its entries.
+class TextDictionary {
+public:
+    static constexpr size_t ChunkBits = 12;
+    static constexpr size_t ChunkSize = size_t(1) << ChunkBits;
+    static constexpr size_t MaxChunks = 4096;
+    static constexpr size_t MaxEntries = ChunkSize * MaxChunks;
+
+    explicit TextDictionary(size_t maxEntries = MaxEntries)
+        : maxEntries_{std::min(maxEntries, MaxEntries)}, values_{}, codes_{}, chunks_{}, count_{0} {}
+
+    TextDictionary(const TextDictionary&) = delete;
+    TextDictionary& operator=(const TextDictionary&) = delete;
+
+    // Whether intern() could run out of codes for a value it hasn't seen.
+    bool full() const { return size() >= maxEntries_; }
+
+    size_t capacity() const { return maxEntries_; }
+
+    // Only the writer may call these.
+    bool contains(folly::StringPiece text) const { return codes_.count(text) > 0; }
+    bool admits(folly::StringPiece text) const { return !full() || contains(text); }
+
+    // The caller checks admits() first: a full dictionary has no code to
+    // give a new value.
+    uint32_t intern(folly::StringPiece text) {
+        auto found = codes_.find(text);
+        if (found != codes_.end()) {
+            return found->second;
+        }
+        uint32_t code = size();
+        auto& chunk = chunks_[code >> ChunkBits];
+        if (!chunk) {
+            chunk.reset(new folly::StringPiece[ChunkSize]);
+        }
+        values_.emplace_back(text.begin(), text.end());
+        folly::StringPiece value(values_.back());
+        chunk[code & (ChunkSize - 1)] = value;
+        codes_.emplace(value, code);
+        count_.store(code + 1, std::memory_order_relaxed);
+        return code;
+    }
+
+    folly::StringPiece lookup(uint32_t code) const {
+        return chunks_[code >> ChunkBits][code & (ChunkSize - 1)];
+    }
+
+    // Safe to call from any thread, as an estimate.
+    size_t size() const { return count_.load(std::memory_order_relaxed); }
+
+private:
+    const size_t maxEntries_;
+    // Strings in a deque stay put as it grows.
+    std::deque<string> values_;
+    std::unordered_map<folly::StringPiece, uint32_t, codec::TextHash> codes_;
+    // Readers go through the chunks, since the deque's own index moves.
+    std::array<std::unique_ptr<folly::StringPiece[]>, MaxChunks> chunks_;
+    std::atomic<size_t> count_;
+};
@@ -39,6 +39,16 @@ string lcString(string inString);
 
 string joinVector(const vector<string>& c, string delim=",");
 
+// What the allocator really hands out for a request of `bytes`, for memory
+// accounting. This models glibc's malloc: an 8 byte header, rounded up to
+// 16 byte chunks of at least 32 bytes.
+inline size_t allocatedBytes(size_t bytes) {
+    if (bytes == 0) {
+        return 0;
+    }
+    return std::max<size_t>(32, (bytes + 8 + 15) & ~size_t{15});
+}
+
 template<class T>
 T randomValue(T lowerBound, T upperBound) {
     static std::random_device rd;
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#pragma once
+
+#include "setab/Row.h"
+#include "setab/Util.h"
+
+#include <folly/Range.h>
+
+enum class WireFormat {
+    TEXT,
+    BINARY,
+};
+
+inline WireFormat parseWireFormat(const string& name) {
+    auto lcName = lcString(trimQuotes(trimString(name)));
+    if (lcName == "text") {
+        return WireFormat::TEXT;
+    } else if (lcName == "binary") {
+        return WireFormat::BINARY;
+    }
+    throw std::invalid_argument("Invalid wire_format. Must be text or binary.");
+}
+
+/**
+ * The binary row format is the schema's columns, in order, with no separators:
+ *   INTEGER: 8 bytes, little-endian two's complement.
+ *   TEXT:    4 byte little-endian length, followed by that many bytes.
+ * Both ends must agree on the schema, since nothing in the row describes it.
+ * Unlike the text format, TEXT may contain any byte, including \036.
+ *
+ * Either way, several rows can go out in one two-part message. The first
+ * part is the length of each row, 4 bytes little-endian apiece, and the
+ * second is the rows back to back. A single-part message is a single row.
+ */
+namespace wire {
+
+constexpr size_t IntegerBytes = 8;
+constexpr size_t LengthBytes = 4;
+
+inline void appendInteger(string& out, int64_t value) {
+    uint64_t bits = static_cast<uint64_t>(value);
+    for (size_t i = 0; i < IntegerBytes; i++) {
+        out.push_back(static_cast<char>((bits >> (8 * i)) & 0xff));
+    }
+}
+
+inline void appendLength(string& out, size_t value) {
+    uint32_t len = static_cast<uint32_t>(value);
+    for (size_t i = 0; i < LengthBytes; i++) {
+        out.push_back(static_cast<char>((len >> (8 * i)) & 0xff));
+    }
+}
+
+inline void appendText(string& out, folly::StringPiece value) {
+    appendLength(out, value.size());
+    out.append(value.data(), value.size());
+}
+
+inline uint64_t readLittleEndian(const char* data, size_t bytes) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        bits |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+    }
+    return bits;
+}
+
+// Decodes one binary row laid out according to `schema` into `columns`.
+// TEXT columns are views into `data`, so it must outlive them.
+// Returns false, leaving `columns` in an unspecified state, if the data is
+// truncated or has trailing bytes.
+inline bool decodeRow(folly::StringPiece data, const vector<Column>& schema, vector<ColumnView>& columns) {
+    const char* pos = data.begin();
+    const char* end = data.end();
+    for (const auto& col : schema) {
+        if (col.type == ColumnType::INTEGER) {
+            if (static_cast<size_t>(end - pos) < IntegerBytes) {
+                return false;
+            }
+            int64_t value = static_cast<int64_t>(readLittleEndian(pos, IntegerBytes));
+            columns.emplace_back(ColumnType::INTEGER, folly::StringPiece(), value);
+            pos += IntegerBytes;
+        } else {
+            if (static_cast<size_t>(end - pos) < LengthBytes) {
+                return false;
+            }
+            size_t len = readLittleEndian(pos, LengthBytes);
+            pos += LengthBytes;
+            if (static_cast<size_t>(end - pos) < len) {
+                return false;
+            }
+            columns.emplace_back(ColumnType::TEXT, folly::StringPiece(pos, len), -1);
+            pos += len;
+        }
+    }
+    return pos == end;
+}
+
+// Splits the rows of a multi-row message into `out`, as views into `rows`.
+// Returns false if the lengths don't add up to the rows.
+inline bool splitRows(folly::StringPiece lengths, folly::StringPiece rows, vector<folly::StringPiece>& out) {
+    if (lengths.size() % LengthBytes != 0) {
+        return false;
+    }
+    const char* pos = rows.begin();
+    for (const char* len = lengths.begin(); len != lengths.end(); len += LengthBytes) {
+        size_t rowBytes = readLittleEndian(len, LengthBytes);
+        if (static_cast<size_t>(rows.end() - pos) < rowBytes) {
+            return false;
+        }
+        out.emplace_back(pos, rowBytes);
+        pos += rowBytes;
+    }
+    return pos == rows.end();
+}
+
+} // namespace wire
@@ -26,6 +26,473 @@
 #include <folly/dynamic.h>
 #include <folly/json.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <thread>
+
+#include <signal.h>
+#include <unistd.h>
+
+// Insertions are grouped into transactions of up to `rows` rows, or as many
+// as come in within `interval`, whichever fills up first. With neither set,
+// every insertion commits on its own.
+struct CommitPolicy {
+    size_t rows{0};
+    milliseconds interval{0};
+
+    bool grouped() const { return rows > 0 || interval > 0ms; }
+};
+
+/*
+ * A pipeline is a group of selections along with the insertions that consume
+ * their rows. Selections that feed a common insertion have to be stepped
+ * together, but separate pipelines share nothing but the tables, so with
+ * "threads" set in the config each one gets its own connection and the
+ * pipelines are spread over that many worker threads. Connections reach the
+ * same setab tables through the registry. The worker connections have to
+ * share the database, so with threads an in-memory one (":memory:", or no
+ * name) is really a scratch file in /tmp, removed when the engine stops.
+ *
+ * Stepping a selection can block on its stream, so a selection is only
+ * stepped while its scans have buffered rows left to read, when one of the
+ * setab tables it reads has taken in rows since its scans caught up, or when
+ * the window of a query it's in the middle of has run out. Selections over
+ * plain tables alone are stepped every time.
+ *
+ * Writes to plain tables pay for a journal commit each, so the insertions
+ * can be grouped into transactions instead. See CommitPolicy.
+ */
+class Pipeline {
+public:
+    Pipeline(Sqlite3Db& db, SetabRegistry& registry, const folly::dynamic& queryConfig,
+             vector<size_t> selectionIds, vector<size_t> insertionIds, CommitPolicy commit)
+        : db_(db),
+          registry_(registry),
+          queryConfig_(queryConfig),
+          selectionIds_(move(selectionIds)),
+          insertionIds_(move(insertionIds)),
+          commit_(commit),
+          txnRows_(0),
+          txnStarted_(0) {}
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    ~Pipeline() {
+        // Rows inserted before an abort stay, the same as without grouping.
+        if (txn_) {
+            try {
+                txn_->commit();
+            } catch (const Sqlite3Exception& ex) {
+                std::cout << "Unable to commit insertions: " << ex.what() << "\n";
+            }
+        }
+        for (auto stmt : selections_) {
+            sqlite3_finalize(stmt);
+        }
+        for (auto stmt : insertions_) {
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    bool prepare() {
+        for (size_t id : selectionIds_) {
+            const char* querySQL = queryConfig_["selections"][id].c_str();
+            selections_.push_back(nullptr);
+            // SQLite asks the authorizer about every table the query reads,
+            // which is how we find the streams it waits on.
+            std::set<string> tableNames;
+            sqlite3_set_authorizer(db_.raw(), noteRead, &tableNames);
+            int rc = sqlite3_prepare_v2(db_.raw(), querySQL, -1, &selections_.back(), nullptr);
+            sqlite3_set_authorizer(db_.raw(), nullptr, nullptr);
+            if (rc) {
+                std::cout << "Unable to compile selection query: " << db_.errmsg() << "\n";
+                return false;
+            }
+            std::cout << "Compiled query: " << querySQL << "\n";
+
+            SelectionState state;
+            for (const auto& name : tableNames) {
+                if (auto table = registry_.getTable(name)) {
+                    state.window = std::min(state.window, table->windowSize());
+                    state.inputs.push_back(move(table));
+                    state.seen.push_back(0);
+                    state.behind.push_back(false);
+                }
+            }
+            state.runSeen = state.seen;
+            states_.push_back(move(state));
+        }
+
+        for (size_t id : insertionIds_) {
+            const char* insertSQL = queryConfig_["insertions"][id]["query"].c_str();
+            insertions_.push_back(nullptr);
+            if (sqlite3_prepare_v2(db_.raw(), insertSQL, -1, &insertions_.back(), nullptr)) {
+                std::cout << "Unable to compile insertion query: " << db_.errmsg() << "\n";
+                return false;
+            }
+            std::cout << "Compiled query: " << insertSQL << "\n";
+        }
+        return true;
+    }
+
+    // Steps the selections that have something to do, then performs the
+    // insertions that have a row from each of their selections. Errors in
+    // either abort the engine. `stepped` counts the selections stepped, and
+    // `wakeAt` is pulled in to the next window deadline of one that wasn't.
+    bool step(size_t& stepped, milliseconds& wakeAt) {
+        auto now = nowMs();
+        // Stepping a selection can block on its stream, so a transaction
+        // that's due doesn't wait on that to commit.
+        if (!commitIfDue(now, wakeAt)) {
+            return false;
+        }
+        // Reset selections if they finish, and abort if there's an error.
+        for (size_t i=0; i < selections_.size(); i++) {
+            auto& state = states_[i];
+            if (!ready(state, now, wakeAt)) {
+                continue;
+            }
+            for (size_t k=0; k < state.inputs.size(); k++) {
+                state.seen[k] = state.inputs[k]->writeSequence();
+            }
+            if (!state.running) {
+                state.runSeen = state.seen;
+                state.started = now;
+            }
+            stepped++;
+            // A new row replaces the last one, whether or not it got used.
+            ready_.erase(selectionIds_[i]);
+            // The write lock mustn't be held while the step waits, or other
+            // pipelines' writes would time out on it.
+            if (mayWait(state) && !commitNow()) {
+                return false;
+            }
+
+            sqlite3_stmt* stmt = selections_[i];
+            StreamProbe probe;
+            int rc = sqlite3_step(stmt);
+            switch (rc) {
+                case SQLITE_ROW:
+                    std::cout << "Got row from: " << selectionIds_[i] << "\n";
+                    ready_.insert(selectionIds_[i]);
+                    state.running = true;
+                    for (size_t k=0; k < state.inputs.size(); k++) {
+                        state.behind[k] = probe.behind(state.inputs[k].get(), state.seen[k]);
+                    }
+                    break;
+                case SQLITE_DONE:
+                    std::cout << "Completed: " << selectionIds_[i] << "\n";
+                    sqlite3_reset(stmt);
+                    // The next run starts from the top, so it owes a look at
+                    // anything that came in since this one started.
+                    state.running = false;
+                    state.seen = state.runSeen;
+                    state.behind.assign(state.inputs.size(), false);
+                    break;
+                default:
+                    std::cout << "Query `" << sqlite3_sql(stmt) << "` experienced an error:" << db_.errmsg();
+                    std::cout << "Aborting.\n";
+                    return false;
+            }
+        }
+
+        std::unordered_set<size_t> used;
+        for (size_t j=0; j < insertions_.size(); j++) {
+            sqlite3_stmt* insertStmt = insertions_[j];
+            int c=1;
+            bool canInsert = true;
+            for (auto& selectData : queryConfig_["insertions"][insertionIds_[j]]["selections"].items()) {
+                size_t selectIndex = selectData.first.asInt();
+                if (!ready_.count(selectIndex)) {
+                    canInsert = false;
+                    continue;
+                }
+                sqlite3_stmt* selectStmt = selections_[localSelection(selectIndex)];
+                for (auto& columnIndex : selectData.second) {
+                    sqlite3_value* value = sqlite3_column_value(selectStmt, columnIndex.getInt());
+                    sqlite3_bind_value(insertStmt, c, value);
+                    c++;
+                }
+            }
+            if (!canInsert) {
+                sqlite3_reset(insertStmt);
+                continue;
+            }
+            if (commit_.grouped() && !txn_) {
+                try {
+                    txn_.reset(new Sqlite3Db::TransactionProxy(&db_));
+                } catch (const Sqlite3Exception& ex) {
+                    std::cout << "Unable to begin transaction: " << ex.what() << "\n";
+                    return false;
+                }
+                txnRows_ = 0;
+                txnStarted_ = nowMs();
+            }
+            if (sqlite3_step(insertStmt) != SQLITE_DONE) {
+                std::cout << "Failed to write to table " << insertionIds_[j] << "\n";
+                std::cout << "Aborting.\n";
+                return false;
+            }
+            sqlite3_reset(insertStmt);
+            txnRows_++;
+            for (auto& selectData : queryConfig_["insertions"][insertionIds_[j]]["selections"].items()) {
+                used.insert(selectData.first.asInt());
+            }
+        }
+        for (size_t selectIndex : used) {
+            ready_.erase(selectIndex);
+        }
+        return commitIfDue(nowMs(), wakeAt);
+    }
+
+private:
+    struct SelectionState {
+        // The setab tables the selection reads, and their write sequences as
+        // of the last step and as of the start of the current run.
+        vector<std::shared_ptr<Setab>> inputs;
+        vector<size_t> seen;
+        vector<size_t> runSeen;
+        // Whether the last step left rows of each table buffered but unread.
+        vector<bool> behind;
+        milliseconds window{milliseconds::max()};
+        bool running{false};
+        milliseconds started{0};
+    };
+
+    static int noteRead(void* tableNames, int action, const char* table, const char*, const char*, const char*) {
+        if (action == SQLITE_READ && table != nullptr) {
+            static_cast<std::set<string>*>(tableNames)->insert(table);
+        }
+        return SQLITE_OK;
+    }
+
+    static bool ready(const SelectionState& state, milliseconds now, milliseconds& wakeAt) {
+        if (state.inputs.empty()) {
+            return true;
+        }
+        for (size_t k=0; k < state.inputs.size(); k++) {
+            if (state.behind[k] || state.inputs[k]->writeSequence() != state.seen[k]) {
+                return true;
+            }
+        }
+        if (state.running) {
+            auto deadline = state.started + state.window;
+            if (now >= deadline) {
+                return true;
+            }
+            wakeAt = std::min(wakeAt, deadline);
+        }
+        return false;
+    }
+
+    // Commits the open transaction once it's full or has been open long
+    // enough. Otherwise `wakeAt` is pulled in to when it will have been.
+    bool commitIfDue(milliseconds now, milliseconds& wakeAt) {
+        if (!txn_) {
+            return true;
+        }
+        bool full = commit_.rows > 0 && txnRows_ >= commit_.rows;
+        bool expired = commit_.interval > 0ms && now - txnStarted_ >= commit_.interval;
+        if (!full && !expired) {
+            if (commit_.interval > 0ms) {
+                wakeAt = std::min(wakeAt, txnStarted_ + commit_.interval);
+            }
+            return true;
+        }
+        return commitNow();
+    }
+
+    bool commitNow() {
+        if (!txn_) {
+            return true;
+        }
+        try {
+            txn_->commit();
+        } catch (const Sqlite3Exception& ex) {
+            std::cout << "Unable to commit insertions: " << ex.what() << "\n";
+            std::cout << "Aborting.\n";
+            return false;
+        }
+        txn_.reset();
+        return true;
+    }
+
+    // Whether stepping the selection may wait on a stream, which is unless
+    // every scan it has going still has buffered rows to read.
+    static bool mayWait(const SelectionState& state) {
+        return std::find(state.behind.begin(), state.behind.end(), false) != state.behind.end();
+    }
+
+    size_t localSelection(size_t selectIndex) const {
+        return std::find(selectionIds_.begin(), selectionIds_.end(), selectIndex) - selectionIds_.begin();
+    }
+
+    Sqlite3Db& db_;
+    SetabRegistry& registry_;
+    const folly::dynamic& queryConfig_;
+    // Indexes into the config's selections and insertions.
+    vector<size_t> selectionIds_;
+    vector<size_t> insertionIds_;
+    vector<sqlite3_stmt*> selections_;
+    vector<SelectionState> states_;
+    vector<sqlite3_stmt*> insertions_;
+    // Selections with a row that no insertion has used yet.
+    std::unordered_set<size_t> ready_;
+    CommitPolicy commit_;
+    std::unique_ptr<Sqlite3Db::TransactionProxy> txn_;
+    size_t txnRows_;
+    milliseconds txnStarted_;
+};
+
+// Sets the journal_mode and synchronous pragmas from the config, if given.
+// They're per connection, or at least synchronous is.
+void configureConnection(Sqlite3Db& db, const folly::dynamic& queryConfig) {
+    if (queryConfig.count("journal_mode")) {
+        db.exec("PRAGMA journal_mode=" + queryConfig["journal_mode"].asString() + ";");
+    }
+    if (queryConfig.count("synchronous")) {
+        db.exec("PRAGMA synchronous=" + queryConfig["synchronous"].asString() + ";");
+    }
+}
+
+// A database file that only lasts as long as the engine, for worker
+// connections to share when the config asks for an in-memory one.
+class ScratchDb {
+public:
+    ScratchDb() : path_{} {}
+
+    ScratchDb(const ScratchDb&) = delete;
+    ScratchDb& operator=(const ScratchDb&) = delete;
+
+    ~ScratchDb() {
+        if (!path_.empty()) {
+            unlink(path_.c_str());
+            unlink((path_ + "-wal").c_str());
+            unlink((path_ + "-shm").c_str());
+        }
+    }
+
+    const string& create() {
+        char path[] = "/tmp/setab-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            throw std::runtime_error(string("Couldn't create scratch db: ") + std::strerror(errno));
+        }
+        close(fd);
+        path_ = path;
+        return path_;
+    }
+
+    bool created() const { return !path_.empty(); }
+
+private:
+    string path_;
+};
+
+// Set on SIGINT or SIGTERM, to have the engine stop and clean up after
+// itself. A second signal kills it outright.
+std::atomic<bool> stopRequested{false};
+
+void requestStop(int) {
+    stopRequested = true;
+}
+
+void handleStopSignals() {
+    struct sigaction action{};
+    action.sa_handler = requestStop;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+// How long a write may wait for another pipeline's transaction to commit.
+// One can stay open for the commit interval, and meanwhile a pipeline on the
+// same thread may step a selection that waits on its stream for up to a
+// window. The minimum covers everything else.
+constexpr milliseconds MinBusyTimeout = 1000ms;
+
+int busyTimeoutMs(SetabRegistry& registry, const CommitPolicy& commit) {
+    milliseconds window{0};
+    for (const auto& table : registry.liveTables()) {
+        window = std::max(window, table->windowSize());
+    }
+    return static_cast<int>((MinBusyTimeout + commit.interval + window).count());
+}
+
+// How long an idle engine sleeps before looking around again, at most.
+constexpr milliseconds IdleWait = 1000ms;
+
+// Steps the pipelines whenever there's something for them to do, and sleeps
+// until a table takes in rows or a window runs out otherwise. Returns once a
+// pipeline fails, `failed` gets set elsewhere, or the engine is asked to stop.
+void runPipelines(SetabRegistry& registry, const vector<Pipeline*>& pipelines, std::atomic<bool>& failed) {
+    while (!failed && !stopRequested) {
+        size_t seq = registry.ingestSequence();
+        size_t stepped = 0;
+        milliseconds wakeAt = nowMs() + IdleWait;
+        for (auto pipeline : pipelines) {
+            if (!pipeline->step(stepped, wakeAt)) {
+                failed = true;
+                return;
+            }
+        }
+        auto idle = wakeAt - nowMs();
+        if (stepped == 0 && idle > 0ms) {
+            registry.waitForIngest(seq, idle);
+        }
+    }
+}
+
+// Groups selections that feed a common insertion. Returns the selection ids
+// of each pipeline, and the insertion ids that go with them.
+vector<std::pair<vector<size_t>, vector<size_t>>> groupPipelines(const folly::dynamic& queryConfig) {
+    size_t selectionCount = queryConfig["selections"].size();
+    vector<size_t> group(selectionCount);
+    for (size_t i=0; i < selectionCount; i++) {
+        group[i] = i;
+    }
+    auto root = [&group](size_t i) {
+        while (group[i] != i) {
+            i = group[i] = group[group[i]];
+        }
+        return i;
+    };
+
+    for (const auto& insertData : queryConfig["insertions"]) {
+        size_t first = selectionCount;
+        for (auto& selectData : insertData["selections"].items()) {
+            size_t selectIndex = selectData.first.asInt();
+            if (first == selectionCount) {
+                first = root(selectIndex);
+            } else {
+                group[root(selectIndex)] = first;
+            }
+        }
+    }
+
+    vector<std::pair<vector<size_t>, vector<size_t>>> pipelines;
+    unordered_map<size_t, size_t> pipelineOf;
+    for (size_t i=0; i < selectionCount; i++) {
+        auto inserted = pipelineOf.insert({root(i), pipelines.size()});
+        if (inserted.second) {
+            pipelines.emplace_back();
+        }
+        pipelines[inserted.first->second].first.push_back(i);
+    }
+    for (size_t j=0; j < queryConfig["insertions"].size(); j++) {
+        size_t selectIndex = queryConfig["insertions"][j]["selections"].items().begin()->first.asInt();
+        pipelines[pipelineOf[root(selectIndex)]].second.push_back(j);
+    }
+    return pipelines;
+}
+
 int main(int argc, char** argv) {
     const char* dbName;
     folly::dynamic queryConfig = folly::dynamic::object;
@@ -39,10 +506,73 @@ int main(int argc, char** argv) {
         queryConfig = folly::parseJson(configContent);
     }
 
+    if (!queryConfig.count("tables") ||
+        !queryConfig.count("selections") ||
+        !queryConfig.count("insertions")) {
+        std::cout << "Configuration seems to be missing 'tables', 'selections', or 'insertions'\n";
+        return 1;
+    }
+
+    for (const auto& insertData : queryConfig["insertions"]) {
+        if (!insertData.count("query")) {
+            std::cout << "No query associated for insertion. Need key: `query`.\n";
+            return 1;
+        }
+        if (!insertData.count("selections") || insertData["selections"].size() == 0) {
+            std::cout << "No data to insert for insertion. Need key: `selections`.\n";
+            return 1;
+        }
+        for (auto& selectData : insertData["selections"].items()) {
+            int64_t selectIndex = selectData.first.asInt();
+            if (selectIndex < 0 || static_cast<size_t>(selectIndex) >= queryConfig["selections"].size()) {
+                std::cout << "Insertion reads from a selection that doesn't exist: " << selectIndex << "\n";
+                return 1;
+            }
+        }
+    }
+
+    size_t threadCount = 0;
+    if (queryConfig.count("threads")) {
+        threadCount = queryConfig["threads"].asInt();
+    }
+
+    CommitPolicy commit;
+    if (queryConfig.count("commit_rows")) {
+        commit.rows = queryConfig["commit_rows"].asInt();
+    }
+    if (queryConfig.count("commit_ms")) {
+        commit.interval = milliseconds(queryConfig["commit_ms"].asInt());
+    }
+
+    // Worker connections need to see the tables the main connection makes.
+    // An in-memory database would need a shared cache for that, but its
+    // table locks fail with SQLITE_LOCKED at once instead of waiting out the
+    // busy timeout, so the workers share a scratch file in WAL mode instead.
+    string dbPath = dbName;
+    int openFlags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+    handleStopSignals();
+    ScratchDb scratch;
+    if (threadCount > 0 && (dbPath.empty() || dbPath == ":memory:")) {
+        try {
+            dbPath = scratch.create();
+        } catch (const std::runtime_error& ex) {
+            std::cout << ex.what() << "\n";
+            return 1;
+        }
+    }
+
     SetabRegistry tableRegistry;
+    if (queryConfig.count("zmq_io_threads")) {
+        tableRegistry.setZmqIoThreads(queryConfig["zmq_io_threads"].asInt());
+    }
     Sqlite3Db db;
     try {
-        db.open(dbName);
+        db.open(dbPath, openFlags);
+        if (scratch.created()) {
+            // WAL mode sticks to the file, so every connection gets it.
+            db.exec("PRAGMA journal_mode=WAL;");
+        }
+        configureConnection(db, queryConfig);
     } catch (const Sqlite3Exception& ex) {
         std::cout << "Couldn't open db: " << ex.what();
         return 1;
@@ -54,16 +584,6 @@ int main(int argc, char** argv) {
     }
     std::cout << "Initialized setab module..\n";
 
-    if (!queryConfig.count("tables") ||
-        !queryConfig.count("selections") ||
-        !queryConfig.count("insertions")) {
-        std::cout << "Configuration seems to be missing 'tables', 'selections', or 'insertions'\n";
-        return 1;
-    }
-
-    std::vector<sqlite3_stmt*> selections;
-    std::vector<sqlite3_stmt*> insertions;
-
     for (const auto& createSQL : queryConfig["tables"]) {
         try {
             db.exec(createSQL.c_str());
@@ -73,85 +593,70 @@ int main(int argc, char** argv) {
         }
     }
 
-    for (const auto& querySQL : queryConfig["selections"]) {
-        selections.push_back(nullptr);
-        if (sqlite3_prepare_v2(db.raw(), querySQL.c_str(), -1, &selections.back(), nullptr)) {
-            std::cout << "Unable to compile selection query: " << db.errmsg() << "\n";
-            return 1;
+    if (threadCount == 0) {
+        vector<size_t> selectionIds;
+        for (size_t i=0; i < queryConfig["selections"].size(); i++) {
+            selectionIds.push_back(i);
         }
-        std::cout << "Compiled query: " << querySQL << "\n";
-    }
-
-    for (const auto& insertData : queryConfig["insertions"]) {
-        if (!insertData.count("query")) {
-            std::cout << "No query associated for insertion. Need key: `query`.\n";
-            return 1;
-        }
-        if (!insertData.count("selections")) {
-            std::cout << "No data to insert for insertion. Need key: `selections`.\n";
+        vector<size_t> insertionIds;
+        for (size_t j=0; j < queryConfig["insertions"].size(); j++) {
+            insertionIds.push_back(j);
         }
-        const char* insertSQL = insertData["query"].c_str();
-        insertions.push_back(nullptr);
-        if (sqlite3_prepare_v2(db.raw(), insertSQL, -1, &insertions.back(), nullptr)) {
-            std::cout << "Unable to compile insertion query: " << db.errmsg() << "\n";
+        Pipeline pipeline(db, tableRegistry, queryConfig, selectionIds, insertionIds, commit);
+        if (!pipeline.prepare()) {
             return 1;
         }
-        std::cout << "Compiled query: " << insertSQL << "\n";
+        std::atomic<bool> failed{false};
+        runPipelines(tableRegistry, {&pipeline}, failed);
+        return failed ? 1 : 0;
     }
 
-    std::unordered_set<size_t> fucks;
-    fucks.reserve(selections.size());
-    while (true) {
-        int i=0;
-        // Advance all selections one step.
-        // Reset them if they finish, and abort if there's an error.
-        for (auto stmt : selections) {
-            int rc = sqlite3_step(stmt);
-            switch (rc) {
-                case SQLITE_ROW:
-                    std::cout << "Got row from: " << i << "\n";
-                    fucks.insert(i);
-                    break;
-                case SQLITE_DONE:
-                    std::cout << "Completed: " << i << "\n";
-                    sqlite3_reset(stmt);
-                    break;
-                default:
-                    std::cout << "Query `" << sqlite3_sql(stmt) << "` experienced an error:" << db.errmsg();
-                    std::cout << "Aborting.\n";
-                    return 1;
-            }
-            i++;
-        }
+    int busyTimeout = busyTimeoutMs(tableRegistry, commit);
+    auto pipelines = groupPipelines(queryConfig);
+    threadCount = std::min(threadCount, pipelines.size());
+    std::cout << "Running " << pipelines.size() << " pipelines on " << threadCount << " threads\n";
 
-        int j=0;
-        // Perform all the requested insertions. Failed writes also abort the engine.
-        for (auto insertStmt : insertions) {
-            int c=1;
-            bool canInsert = true;
-            for (auto& selectData : queryConfig["insertions"][j]["selections"].items()) {
-                size_t selectIndex = selectData.first.asInt();
-                if (!fucks.count(selectIndex)) {
-                    canInsert = false;
-                    continue;
+    std::atomic<bool> failed{false};
+    vector<std::thread> workers;
+    for (size_t t=0; t < threadCount; t++) {
+        workers.emplace_back([&, t]() {
+            // Connections go last, after the statements on them.
+            vector<std::unique_ptr<Sqlite3Db>> connections;
+            vector<std::unique_ptr<Pipeline>> mine;
+            for (size_t p=t; p < pipelines.size(); p += threadCount) {
+                connections.emplace_back(new Sqlite3Db());
+                Sqlite3Db& conn = *connections.back();
+                try {
+                    conn.open(dbPath, openFlags);
+                    configureConnection(conn, queryConfig);
+                } catch (const Sqlite3Exception& ex) {
+                    std::cout << "Couldn't open db: " << ex.what();
+                    failed = true;
+                    return;
                 }
-                sqlite3_stmt* selectStmt = selections[selectIndex];
-                for (auto& columnIndex : selectData.second) {
-                    //const char* colName = sqlite3_column_name(selectStmt, columnIndex.getInt());
-                    sqlite3_value* value = sqlite3_column_value(selectStmt, columnIndex.getInt());
-                    sqlite3_bind_value(insertStmt, c, value);
-                    c++;
+                // Writes to plain tables may have to wait for another
+                // pipeline's transaction to commit.
+                sqlite3_busy_timeout(conn.raw(), busyTimeout);
+                if (sqlite3_create_module_v2(conn.raw(), "setab", Sqlite3SetabModule(), &tableRegistry, nullptr)) {
+                    std::cout << "Couldn't make module: " << conn.errmsg() << "\n";
+                    failed = true;
+                    return;
+                }
+                mine.emplace_back(new Pipeline(conn, tableRegistry, queryConfig, pipelines[p].first, pipelines[p].second, commit));
+                if (!mine.back()->prepare()) {
+                    failed = true;
+                    return;
                 }
             }
-            if (canInsert && sqlite3_step(insertStmt) != SQLITE_DONE) {
-                std::cout << "Failed to write to table " << j << "\n";
-                std::cout << "Aborting.\n";
-                return 1;
+            vector<Pipeline*> steps;
+            for (auto& pipeline : mine) {
+                steps.push_back(pipeline.get());
             }
-            sqlite3_reset(insertStmt);
-            j++;
-        }
-        fucks.clear();
+            runPipelines(tableRegistry, steps, failed);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
     }
-    return 0;
+    return failed ? 1 : 0;
 }
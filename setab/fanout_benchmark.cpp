@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Pushes rows through a table partitioned over several ipc:// or inproc://
+// next hops and reports the throughput, how evenly the keys spread, and whether any key
+// showed up at more than one hop.
+
+#include "RowParser.h"
+#include "Setab.h"
+#include "Util.h"
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <set>
+#include <thread>
+#include <unistd.h>
+
+namespace po = boost::program_options;
+
+static const vector<ColumnType> schema = {
+    ColumnType::INTEGER,
+    ColumnType::TEXT,
+    ColumnType::INTEGER,
+};
+
+// Pulls rows off one endpoint until everything's been sent and it's gone
+// quiet, noting the keys it saw.
+static void receive(void* zctx, const string& endpoint, std::atomic<size_t>& received,
+                    const std::atomic<bool>& sent, std::set<string>& keys) {
+    void* sock = zmq_socket(zctx, ZMQ_PULL);
+    int timeoutMs = 100;
+    zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeoutMs, sizeof(timeoutMs));
+    if (zmq_bind(sock, endpoint.c_str()) == -1) {
+        std::cout << "Unable to bind " << endpoint << ": " << zmq_strerror(zmq_errno()) << "\n";
+        zmq_close(sock);
+        return;
+    }
+    TextRowParser parser(schema);
+    while (true) {
+        ZmqMsg first;
+        if (zmq_msg_recv((zmq_msg_t*)first, sock, 0) == -1) {
+            if (sent) {
+                break;
+            }
+            continue;
+        }
+        vector<folly::StringPiece> rows;
+        ZmqMsg second;
+        if (zmq_msg_more((zmq_msg_t*)first)) {
+            zmq_msg_recv((zmq_msg_t*)second, sock, 0);
+            wire::splitRows(folly::StringPiece(static_cast<const char*>(first.data()), first.size()),
+                            folly::StringPiece(static_cast<const char*>(second.data()), second.size()), rows);
+        } else {
+            rows.emplace_back(static_cast<const char*>(first.data()), first.size());
+        }
+        for (auto row : rows) {
+            vector<ColumnView> columns;
+            if (parser.parse(row, columns) == ParseStatus::OK) {
+                keys.insert(std::get<1>(columns[1]).str());
+            }
+        }
+        received += rows.size();
+    }
+    zmq_close(sock);
+}
+
+int main(int argc, char** argv) {
+    po::options_description opts("fanout_benchmark options");
+    opts.add_options()
+        ("help,h", "This help.")
+        ("rows,r", po::value<int>()->default_value(200000),
+         "Number of rows to send.")
+        ("partitions,p", po::value<int>()->default_value(4),
+         "Number of next hops to partition over.")
+        ("keys,k", po::value<int>()->default_value(1000),
+         "Number of distinct keys.")
+        ("send-batch-rows,b", po::value<int>()->default_value(100),
+         "The table's send_batch_rows.")
+        ("commit-rows,c", po::value<int>()->default_value(1000),
+         "Rows inserted per transaction.")
+        ("transport,t", po::value<string>()->default_value("ipc"),
+         "ipc, or inproc over the registry's shared zmq context.")
+    ;
+    po::variables_map options;
+    po::store(po::parse_command_line(argc, argv, opts), options);
+    po::notify(options);
+
+    if (options.count("help")) {
+        std::cout << opts << "\n";
+        return 1;
+    }
+    int rows = options["rows"].as<int>();
+    int partitions = options["partitions"].as<int>();
+    int keyCount = options["keys"].as<int>();
+    int commitRows = std::max(1, options["commit-rows"].as<int>());
+
+    bool inproc = options["transport"].as<string>() == "inproc";
+
+    vector<string> endpoints;
+    for (int i=0; i < partitions; i++) {
+        string name = "setab-fanout-" + std::to_string(getpid()) + "-" + std::to_string(i);
+        endpoints.push_back(inproc ? "inproc://" + name : "ipc:///tmp/" + name);
+    }
+
+    // Declared first so that it outlives the table using its context.
+    SetabRegistry registry;
+    void* zctx = inproc ? registry.zmqContext() : zmq_ctx_new();
+    std::atomic<size_t> received{0};
+    std::atomic<bool> sent{false};
+    vector<std::set<string>> keys(partitions);
+    vector<std::thread> receivers;
+    for (int i=0; i < partitions; i++) {
+        receivers.emplace_back(receive, zctx, endpoints[i], std::ref(received), std::cref(sent), std::ref(keys[i]));
+    }
+
+    Sqlite3Db db;
+    db.open(":memory:");
+    db.create_module("setab", Sqlite3SetabModule(), &registry);
+    db.exec("CREATE VIRTUAL TABLE fanout USING setab(tag TEXT, latency INTEGER, "
+            "next_hop_service='" + folly::join(",", endpoints) + "', partition_by=tag, "
+            "send_batch_rows=" + std::to_string(options["send-batch-rows"].as<int>()) + ", "
+            "shared_context=" + (inproc ? "1" : "0") + ");");
+
+    sqlite3_stmt* insert = nullptr;
+    if (sqlite3_prepare_v2(db.raw(), "INSERT INTO fanout VALUES (?, ?, ?);", -1, &insert, nullptr)) {
+        std::cout << "Unable to compile insert: " << db.errmsg() << "\n";
+        return 1;
+    }
+
+    auto start = steady_clock::now();
+    int64_t ts = nowMs().count();
+    for (int i=0; i < rows; i += commitRows) {
+        auto txn = db.begin();
+        for (int j=i; j < std::min(rows, i + commitRows); j++) {
+            string tag = "key-" + std::to_string(randomValue(0, keyCount - 1));
+            sqlite3_bind_int64(insert, 1, ts + j);
+            sqlite3_bind_text(insert, 2, tag.data(), tag.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int64(insert, 3, randomValue(1500, 12000));
+            if (sqlite3_step(insert) != SQLITE_DONE) {
+                std::cout << "Insert failed: " << db.errmsg() << "\n";
+                return 1;
+            }
+            sqlite3_reset(insert);
+        }
+        txn.commit();
+    }
+    auto giveUp = steady_clock::now() + 30s;
+    while (received < static_cast<size_t>(rows) && steady_clock::now() < giveUp) {
+        std::this_thread::sleep_for(1ms);
+    }
+    auto elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    sent = true;
+    for (auto& receiver : receivers) {
+        receiver.join();
+    }
+    sqlite3_finalize(insert);
+    db.exec("DROP TABLE fanout;");
+
+    std::cout << received << " of " << rows << " rows over " << partitions << " partitions: "
+              << static_cast<int64_t>(received / elapsed) << " rows/s\n";
+    size_t misrouted = 0;
+    std::set<string> seen;
+    for (int i=0; i < partitions; i++) {
+        std::cout << "  " << endpoints[i] << ": " << keys[i].size() << " keys\n";
+        for (const auto& key : keys[i]) {
+            misrouted += !seen.insert(key).second;
+        }
+    }
+    std::cout << "Keys seen at more than one partition: " << misrouted << "\n";
+    if (!inproc) {
+        zmq_ctx_term(zctx);
+    }
+    return misrouted == 0 && received == static_cast<size_t>(rows) ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2016 Brian Smith <brian@linuxfood.net>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Compares text row parsing throughput on a stream_maker style corpus:
+// the original split-then-convert parser against TextRowParser on every
+// instruction set this machine supports.
+
+#include "Row.h"
+#include "RowParser.h"
+#include "Util.h"
+
+#include <boost/program_options.hpp>
+#include <folly/Conv.h>
+#include <folly/String.h>
+
+namespace po = boost::program_options;
+
+static vector<string> messageValues = {
+    "mass-blaster",
+    "horsey",
+    "merble",
+    "blamo mac-n-cheese",
+    "wiz-kid thelma the cool"
+};
+
+static const vector<ColumnType> schema = {
+    ColumnType::INTEGER,
+    ColumnType::TEXT,
+    ColumnType::INTEGER,
+};
+
+// What Setab::parse used to do for every message.
+static bool parseLegacy(folly::StringPiece rowData, vector<ColumnValue>& columns) {
+    vector<folly::StringPiece> rawColumns;
+    folly::split(ColSep, rowData, rawColumns);
+    if (rawColumns.size() != schema.size()) {
+        return false;
+    }
+    for (size_t i=0; i < schema.size(); i++) {
+        if (schema[i] == ColumnType::INTEGER) {
+            try {
+                columns.push_back(std::make_tuple(ColumnType::INTEGER, string{}, folly::to<int64_t>(rawColumns[i])));
+            } catch (const std::range_error& ex) {
+                return false;
+            }
+        } else {
+            columns.push_back(std::make_tuple(ColumnType::TEXT, rawColumns[i].str(), -1));
+        }
+    }
+    return true;
+}
+
+template<class Fn>
+static void report(const char* name, const vector<string>& corpus, size_t corpusBytes, int iterations, Fn parseOne) {
+    size_t parsed = 0;
+    auto start = steady_clock::now();
+    for (int i=0; i < iterations; i++) {
+        for (const auto& msg : corpus) {
+            parsed += parseOne(msg);
+        }
+    }
+    auto elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    double bytes = static_cast<double>(corpusBytes) * iterations;
+    std::cout << name << ": " << static_cast<int64_t>(bytes / elapsed / (1024 * 1024)) << " MiB/s, "
+              << static_cast<int64_t>(parsed / elapsed) << " rows/s\n";
+}
+
+int main(int argc, char** argv) {
+    po::options_description opts("parse_benchmark options");
+    opts.add_options()
+        ("help,h", "This help.")
+        ("rows,r", po::value<int>()->default_value(100000),
+         "Number of distinct rows in the corpus.")
+        ("iterations,i", po::value<int>()->default_value(20),
+         "Number of passes over the corpus per parser.")
+    ;
+    po::variables_map options;
+    po::store(po::parse_command_line(argc, argv, opts), options);
+    po::notify(options);
+
+    if (options.count("help")) {
+        std::cout << opts << "\n";
+        return 1;
+    }
+    int rows = options["rows"].as<int>();
+    int iterations = options["iterations"].as<int>();
+
+    vector<string> corpus;
+    size_t corpusBytes = 0;
+    int64_t ts = nowMs().count();
+    for (int i=0; i < rows; i++) {
+        ts += randomValue(0, 1500);
+        vector<string> msgContent = {
+            std::to_string(ts),
+            messageValues[randomValue(0UL, messageValues.size()-1)],
+            std::to_string(randomValue(1500, 12000))
+        };
+        corpus.push_back(joinVector(msgContent, string(1, ColSep)));
+        corpusBytes += corpus.back().size();
+    }
+    std::cout << "Corpus: " << rows << " rows, " << corpusBytes << " bytes\n";
+
+    report("legacy", corpus, corpusBytes, iterations, [](const string& msg) {
+        vector<ColumnValue> columns;
+        return parseLegacy(msg, columns) ? 1 : 0;
+    });
+
+    for (auto isa : { ParserIsa::SCALAR, ParserIsa::SSE42, ParserIsa::AVX2 }) {
+        if (isa > bestParserIsa()) {
+            break;
+        }
+        TextRowParser parser(schema, isa);
+        vector<ColumnView> columns;
+        report(parserIsaName(isa), corpus, corpusBytes, iterations, [&parser, &columns](const string& msg) {
+            columns.clear();
+            return parser.parse(msg, columns) == ParseStatus::OK ? 1 : 0;
+        });
+    }
+    return 0;
+}
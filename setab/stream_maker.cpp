@@ -21,6 +21,7 @@
  * IN THE SOFTWARE.
  */
 #include "Util.h"
+#include "WireFormat.h"
 
 #include <boost/program_options.hpp>
 #include <folly/Format.h>
@@ -46,6 +47,8 @@ int main(int argc, char** argv) {
          "Stream destination.")
         ("jitter,j", po::value<int>()->default_value(1500),
          "Random interval to wait before sending each message.")
+        ("wire-format,w", po::value<string>()->default_value("text"),
+         "Row encoding to send: text or binary. Must match the table's wire_format.")
     ;
     po::variables_map options;
     po::store(po::parse_command_line(argc, argv, opts), options);
@@ -57,6 +60,7 @@ int main(int argc, char** argv) {
     }
     string destination = options["destination"].as<string>();
     milliseconds jitterMs = milliseconds(options["jitter"].as<int>());
+    WireFormat wireFormat = parseWireFormat(options["wire-format"].as<string>());
 
     void* zctx = zmq_ctx_new();
     void* zsock = zmq_socket(zctx, ZMQ_PUSH);
@@ -69,12 +73,23 @@ int main(int argc, char** argv) {
     }
 
     while (true) {
-        vector<string> msgContent = {
-            std::to_string(nowMs().count()),
-            messageValues[randomValue(0UL, messageValues.size()-1)],
-            std::to_string(randomValue(1500, 12000))
-        };
-        string content = joinVector(msgContent, string(1, '\036'));
+        int64_t ts = nowMs().count();
+        const string& tag = messageValues[randomValue(0UL, messageValues.size()-1)];
+        int64_t latency = randomValue(1500, 12000);
+
+        string content;
+        if (wireFormat == WireFormat::BINARY) {
+            wire::appendInteger(content, ts);
+            wire::appendText(content, tag);
+            wire::appendInteger(content, latency);
+        } else {
+            vector<string> msgContent = {
+                std::to_string(ts),
+                tag,
+                std::to_string(latency)
+            };
+            content = joinVector(msgContent, string(1, '\036'));
+        }
         ZmqMsg m(content);
         std::cout << "Sending: `" << folly::cEscape<string>(folly::StringPiece(content)) << "`\n";
         if (zmq_msg_send((zmq_msg_t*)m, zsock, 0) == -1) {
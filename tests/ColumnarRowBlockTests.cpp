@@ -0,0 +1,464 @@
+// Enable debugging output in the test harness always.
+#define SETAB_ROWBLOCK_DEBUG 1
+#include "setab/ColumnarRowBlock.h"
+
+#include <gtest/gtest.h>
+
+using namespace std::chrono_literals;
+using SmallColumnarBlock = ColumnarRowBlockImpl<10>;
+using SmallColumnarCursor = RowCursorImpl<SmallColumnarBlock>;
+using SmallColumnarBuffer = RowBufferImpl<SmallColumnarBlock>;
+
+namespace {
+    std::shared_ptr<const ColumnarLayout> makeLayout(size_t textBytesPerRow = 16) {
+        return std::make_shared<ColumnarLayout>(vector<Column>{
+            {"ts", ColumnType::INTEGER},
+            {"tag", ColumnType::TEXT},
+            {"latency", ColumnType::INTEGER},
+        }, textBytesPerRow);
+    }
+    Row makeRow(int64_t id, milliseconds ts, std::string tag, int64_t latency) {
+        return Row(id, vector<ColumnValue>{
+            ColumnValue(ColumnType::INTEGER, "", ts.count()),
+            ColumnValue(ColumnType::TEXT, tag, -1),
+            ColumnValue(ColumnType::INTEGER, "", latency),
+        });
+    }
+}
+
+TEST(ColumnarLayout, Slots) {
+    auto layout = makeLayout();
+    EXPECT_EQ(2, layout->integerColumns);
+    EXPECT_EQ(1, layout->textColumns);
+    EXPECT_EQ(0, layout->slots[0]);
+    EXPECT_EQ(0, layout->slots[1]);
+    EXPECT_EQ(1, layout->slots[2]);
+}
+
+TEST(ColumnarRowBlock, InsertAndRead) {
+    auto block = SmallColumnarBlock::create(makeLayout());
+    EXPECT_EQ(false, block->front().valid());
+
+    Row r1 = makeRow(1, 10ms, "horsey", 1500);
+    Row r2 = makeRow(2, 8ms, "", 12000);
+    EXPECT_EQ(true, block->appendRow(r1));
+    EXPECT_EQ(true, block->appendRow(r2));
+    EXPECT_EQ(2, block->size());
+    EXPECT_EQ(8ms, block->minMaxTime().first);
+    EXPECT_EQ(10ms, block->minMaxTime().second);
+
+    auto row = block->at(0);
+    ASSERT_EQ(true, row.valid());
+    EXPECT_EQ(1, row.rowId());
+    EXPECT_EQ(10ms, row.ts());
+    EXPECT_EQ(3, row.columnCount());
+    EXPECT_EQ("horsey", std::get<1>(row.column(1)).str());
+    EXPECT_EQ(1500, std::get<2>(row.column(2)));
+
+    EXPECT_EQ(2, block->back().rowId());
+    EXPECT_EQ("", std::get<1>(block->back().column(1)).str());
+
+    const int64_t* latency = block->integers(2);
+    EXPECT_EQ(1500 + 12000, latency[0] + latency[1]);
+}
+
+TEST(ColumnarRowBlock, TextArenaSealsBlock) {
+    // 10 rows * 4 bytes of arena for the tag column.
+    auto block = SmallColumnarBlock::create(makeLayout(4));
+    Row big = makeRow(1, 1ms, std::string(30, 'x'), 1);
+    EXPECT_EQ(true, block->appendRow(big));
+    Row next = makeRow(2, 2ms, std::string(20, 'y'), 2);
+    EXPECT_EQ(false, block->appendRow(next)) << "arena overflowed";
+
+    // An empty block always takes the row, however big.
+    auto fresh = SmallColumnarBlock::create(makeLayout(4));
+    Row huge = makeRow(3, 3ms, std::string(100, 'z'), 3);
+    EXPECT_EQ(true, fresh->appendRow(huge));
+    EXPECT_EQ(std::string(100, 'z'), std::get<1>(fresh->at(0).column(1)).str());
+}
+
+TEST(ColumnarRowBlock, Reset) {
+    auto block = SmallColumnarBlock::create(makeLayout(4));
+    Row huge = makeRow(1, 5ms, std::string(100, 'z'), 1);
+    EXPECT_EQ(true, block->appendRow(huge));
+    block->reset();
+    EXPECT_EQ(0, block->size());
+    EXPECT_EQ(false, block->front().valid());
+
+    // The arena went back to its usual size along with the rows.
+    Row r1 = makeRow(2, 6ms, std::string(30, 'x'), 2);
+    Row r2 = makeRow(3, 7ms, std::string(20, 'y'), 3);
+    EXPECT_EQ(true, block->appendRow(r1));
+    EXPECT_EQ(false, block->appendRow(r2));
+    EXPECT_EQ(6ms, block->minMaxTime().first);
+    EXPECT_EQ(std::string(30, 'x'), std::get<1>(block->at(0).column(1)).str());
+}
+
+TEST(ColumnarRowBlock, SpillTo) {
+    auto block = SmallColumnarBlock::create(makeLayout());
+    for (int i=0; i < 7; ++i) {
+        Row r = makeRow(i, milliseconds(10 - i), "tag" + std::to_string(i), i * 100);
+        block->appendRow(r);
+    }
+    auto segment = SpillSegment::create("/tmp", 4096);
+    auto copy = block->spillTo(segment);
+    EXPECT_EQ(block->spillSize(), segment->capacity() - segment->remaining());
+    EXPECT_EQ(true, copy->spilled());
+    EXPECT_EQ(false, block->spilled());
+    EXPECT_GT(block->byteSize(), copy->byteSize());
+    EXPECT_EQ(block->spillSize(), copy->spilledBytes());
+
+    EXPECT_EQ(7, copy->size());
+    EXPECT_EQ(block->minMaxTime(), copy->minMaxTime());
+    EXPECT_EQ(false, copy->ordered());
+    for (int i=0; i < 7; ++i) {
+        auto row = copy->at(i);
+        EXPECT_EQ(i, row.rowId());
+        EXPECT_EQ(milliseconds(10 - i), row.ts());
+        EXPECT_EQ("tag" + std::to_string(i), std::get<1>(row.column(1)).str());
+        EXPECT_EQ(i * 100, std::get<2>(row.column(2)));
+    }
+    EXPECT_EQ(false, copy->at(7).valid());
+}
+
+TEST(ColumnarRowBlock, Compress) {
+    // Few distinct tags are dictionary encoded; unique ones are kept raw.
+    for (bool repeated : {true, false}) {
+        auto block = SmallColumnarBlock::create(makeLayout(40));
+        const int64_t latencies[] = {5, -7, INT64_MAX, INT64_MIN, 0, 1 << 20, -1};
+        for (int i=0; i < 7; ++i) {
+            std::string tag = repeated ? "tag" + std::to_string(i % 2) : std::string(30, 'a' + i);
+            Row r = makeRow(i, milliseconds(1000 - i * 3), tag, latencies[i]);
+            block->appendRow(r);
+        }
+        auto copy = block->compress();
+        ASSERT_NE(nullptr, copy);
+        EXPECT_EQ(true, copy->compressed());
+        EXPECT_EQ(nullptr, copy->compress());
+        EXPECT_GT(block->byteSize(), copy->byteSize());
+        EXPECT_EQ(block->minMaxTime(), copy->minMaxTime());
+        EXPECT_EQ(7, copy->size());
+
+        auto segment = SpillSegment::create("/tmp", 4096);
+        auto spilled = copy->spillTo(segment);
+        EXPECT_EQ(true, spilled->spilled());
+        EXPECT_EQ(true, spilled->compressed());
+
+        for (auto& compressed : {copy.get(), spilled.get()}) {
+            auto decoded = compressed->decompress();
+            ASSERT_EQ(7, decoded->size());
+            for (int i=0; i < 7; ++i) {
+                auto row = decoded->at(i);
+                auto original = block->at(i);
+                EXPECT_EQ(i, row.rowId());
+                EXPECT_EQ(original.ts(), row.ts());
+                EXPECT_EQ(std::get<1>(original.column(1)).str(), std::get<1>(row.column(1)).str());
+                EXPECT_EQ(latencies[i], std::get<2>(row.column(2)));
+            }
+        }
+    }
+}
+
+TEST(ColumnarRowBlock, InternedColumn) {
+    auto layout = std::make_shared<ColumnarLayout>(vector<Column>{
+        {"ts", ColumnType::INTEGER},
+        {"tag", ColumnType::TEXT},
+        {"latency", ColumnType::INTEGER},
+    });
+    EXPECT_THROW(layout->internColumn(0), std::invalid_argument);
+    layout->internColumn(1);
+    EXPECT_EQ(true, layout->interned(1));
+    EXPECT_EQ(false, layout->interned(2));
+
+    auto block = SmallColumnarBlock::create(layout);
+    auto other = SmallColumnarBlock::create(layout);
+    EXPECT_GT(SmallColumnarBlock::create(makeLayout())->byteSize(), block->byteSize());
+    for (int i=0; i < 10; ++i) {
+        Row r = makeRow(i, milliseconds(i), "tag" + std::to_string(i % 3), i);
+        block->appendRow(r);
+        other->appendRow(r);
+    }
+    EXPECT_EQ(3, layout->dictionaries[0]->size());
+    EXPECT_EQ(true, block->at(4).interned(1));
+    EXPECT_EQ("tag1", std::get<1>(block->at(4).column(1)).str());
+    // The same value reads from the same bytes, whichever block it's in.
+    EXPECT_EQ(std::get<1>(block->at(4).column(1)).data(), std::get<1>(other->at(4).column(1)).data());
+
+    auto segment = SpillSegment::create("/tmp", 4096);
+    auto spilled = block->spillTo(segment);
+    auto decoded = block->compress()->decompress();
+    for (int i=0; i < 10; ++i) {
+        EXPECT_EQ("tag" + std::to_string(i % 3), std::get<1>(spilled->at(i).column(1)).str());
+        EXPECT_EQ("tag" + std::to_string(i % 3), std::get<1>(decoded->at(i).column(1)).str());
+    }
+}
+
+TEST(ColumnarRowBlock, IndexedColumns) {
+    auto layout = std::make_shared<ColumnarLayout>(vector<Column>{
+        {"ts", ColumnType::INTEGER},
+        {"tag", ColumnType::TEXT},
+        {"latency", ColumnType::INTEGER},
+    });
+    layout->indexColumn(1);
+    layout->indexColumn(2);
+    EXPECT_EQ(1, layout->indexOf(2));
+    EXPECT_EQ(-1, layout->indexOf(0));
+
+    auto block = SmallColumnarBlock::create(layout);
+    for (int i=0; i < 10; ++i) {
+        Row r = makeRow(i, milliseconds(i), "tag" + std::to_string(i % 3), i % 4 - 2);
+        block->appendRow(r);
+    }
+    ColumnView tag1(ColumnType::TEXT, "tag1", -1);
+    ColumnView minusOne(ColumnType::INTEGER, folly::StringPiece(), -1);
+    auto checkMatches = [&](const SmallColumnarBlock& b) {
+        EXPECT_EQ(1, b.nextMatch(1, tag1, 0, 10));
+        EXPECT_EQ(4, b.nextMatch(1, tag1, 2, 10));
+        EXPECT_EQ(7, b.nextMatch(1, tag1, 5, 10));
+        EXPECT_EQ(7, b.nextMatch(1, tag1, 5, 7));
+        EXPECT_EQ(10, b.nextMatch(1, ColumnView(ColumnType::TEXT, "nope", -1), 0, 10));
+        EXPECT_EQ(5, b.nextMatch(2, minusOne, 2, 10));
+    };
+    // Scanned before the block is sealed, and looked up after.
+    checkMatches(*block);
+    block->seal();
+    checkMatches(*block);
+
+    auto segment = SpillSegment::create("/tmp", 4096);
+    checkMatches(*block->spillTo(segment));
+    checkMatches(*block->compress()->decompress());
+}
+
+TEST(ColumnarRowBlock, ZoneMaps) {
+    auto block = SmallColumnarBlock::create(makeLayout());
+    for (int i=0; i < 10; ++i) {
+        Row r = makeRow(i, milliseconds(100 + i), "tag", i * i - 20);
+        block->appendRow(r);
+    }
+    // Nothing is ruled out until the block is sealed.
+    EXPECT_EQ(true, block->mayContain(2, 1000, 2000));
+    block->seal();
+    EXPECT_EQ(std::make_pair(int64_t(-20), int64_t(61)), block->zone(2));
+    EXPECT_EQ(std::make_pair(int64_t(100), int64_t(109)), block->zone(0));
+    EXPECT_EQ(false, block->mayContain(2, 62, 1000));
+    EXPECT_EQ(false, block->mayContain(2, -100, -21));
+    EXPECT_EQ(true, block->mayContain(2, 61, 61));
+    EXPECT_EQ(6, block->nextInRange(2, 10, 20, 0, 10));
+    EXPECT_EQ(10, block->nextInRange(2, 17, 20, 0, 10));
+
+    auto compressed = block->compress();
+    EXPECT_EQ(false, compressed->mayContain(2, 62, 1000));
+    auto segment = SpillSegment::create("/tmp", 4096);
+    EXPECT_EQ(block->zone(2), block->spillTo(segment)->zone(2));
+}
+
+TEST(ColumnarRowBlock, MismatchedRow) {
+    auto block = SmallColumnarBlock::create(makeLayout());
+    Row r(1, vector<ColumnValue>{ ColumnValue(ColumnType::INTEGER, "", 1) });
+    EXPECT_THROW(block->appendRow(r), std::invalid_argument);
+}
+
+TEST(ColumnarRowBuffer, CursorAcrossBlocks) {
+    SmallColumnarBuffer buffer(100, 60000, 9600ms, makeLayout());
+    SmallColumnarCursor c = buffer.getCursor();
+    vector<Row> batch;
+    for (int i=0; i < 25; ++i) {
+        batch.push_back(makeRow(i, milliseconds(i), "tag" + std::to_string(i), i * 10));
+    }
+    buffer.appendRows(batch);
+    EXPECT_EQ(25, buffer.stats().totalRows);
+    EXPECT_EQ(25, buffer.totalRows());
+    EXPECT_EQ(3, buffer.stats().totalBlocks);
+
+    for (int j=0; j < 24; j++) {
+        EXPECT_EQ(j, c.get().rowId());
+        EXPECT_EQ("tag" + std::to_string(j), std::get<1>(c.get().column(1)).str());
+        EXPECT_EQ(true, c.next());
+    }
+    EXPECT_EQ(false, c.next());
+
+    SmallColumnarCursor c2 = buffer.getCursor();
+    EXPECT_EQ(true, c2.seek(17ms));
+    EXPECT_EQ(17, c2.get().rowId());
+}
+
+TEST(ColumnarRowBuffer, FullDictionaryDropsNewValues) {
+    auto layout = std::make_shared<ColumnarLayout>(vector<Column>{
+        {"ts", ColumnType::INTEGER},
+        {"tag", ColumnType::TEXT},
+        {"latency", ColumnType::INTEGER},
+    });
+    layout->internColumn(1, 4);
+    // Even under backpressure, since waiting won't make room.
+    SmallColumnarBuffer buffer(1000, 1000000, 9600000ms, layout, OverflowPolicy::BACKPRESSURE);
+    vector<Row> batch;
+    for (int i=0; i < 30; ++i) {
+        batch.push_back(makeRow(i, milliseconds(i), "tag" + std::to_string(i % 6), i));
+    }
+    EXPECT_EQ(true, buffer.appendRows(batch));
+    EXPECT_EQ(true, batch.empty());
+    EXPECT_EQ(4, layout->dictionaries[0]->size());
+    EXPECT_EQ(20, buffer.stats().totalRows);
+    EXPECT_EQ(10, buffer.stats().droppedRows);
+
+    // Values the dictionary already has still go in.
+    Row known = makeRow(30, 30ms, "tag3", 30);
+    EXPECT_EQ(true, buffer.appendRow(known));
+    Row unknown = makeRow(31, 31ms, "tag4", 31);
+    EXPECT_EQ(false, buffer.appendRow(unknown));
+    EXPECT_EQ(21, buffer.stats().totalRows);
+    EXPECT_EQ(11, buffer.stats().droppedRows);
+
+    SmallColumnarCursor c = buffer.getCursor();
+    for (int i=0; i < 20; ++i) {
+        EXPECT_EQ("tag" + std::to_string(c.get().rowId() % 6), std::get<1>(c.get().column(1)).str());
+        EXPECT_GT(4, c.get().rowId() % 6);
+        c.next();
+    }
+}
+
+TEST(ColumnarRowBuffer, FindNext) {
+    auto layout = std::make_shared<ColumnarLayout>(vector<Column>{
+        {"ts", ColumnType::INTEGER},
+        {"tag", ColumnType::TEXT},
+        {"latency", ColumnType::INTEGER},
+    });
+    layout->indexColumn(1);
+    SmallColumnarBuffer buffer(100, 60000, 9600ms, layout);
+    SmallColumnarCursor c = buffer.getCursor();
+    for (int i=0; i < 25; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i), i % 7 == 3 ? "rare" : "common", i));
+    }
+    ColumnView rare(ColumnType::TEXT, "rare", -1);
+    for (int expected : {3, 10, 17, 24}) {
+        ASSERT_EQ(true, c.findNext(1, rare));
+        EXPECT_EQ(expected, c.get().rowId());
+        if (expected < 24) {
+            EXPECT_EQ(true, c.next());
+        }
+    }
+    // Nothing more in the unsealed tail, so the cursor waits at its end.
+    EXPECT_EQ(false, c.findNext(1, ColumnView(ColumnType::TEXT, "missing", -1)));
+    EXPECT_EQ(24, c.get().rowId());
+}
+
+TEST(ColumnarRowBuffer, FindInRange) {
+    SmallColumnarBuffer buffer(1000, 1000000, 9600000ms, makeLayout(), OverflowPolicy::EVICT,
+                               SpillOptions{}, true);
+    SmallColumnarCursor c = buffer.getCursor();
+    for (int i=0; i < 100; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i), "tag", i == 42 || i == 97 ? 10000 : i % 10));
+    }
+    for (int wait=0; wait < 1000 && buffer.stats().compressedBlocks < 9; ++wait) {
+        std::this_thread::sleep_for(1ms);
+        buffer.adviseGC();
+    }
+    ASSERT_EQ(true, c.findInRange(2, 10000, std::numeric_limits<int64_t>::max()));
+    EXPECT_EQ(42, c.get().rowId());
+    ASSERT_EQ(true, c.next());
+    // The last outlier is in the unsealed tail, which is scanned.
+    ASSERT_EQ(true, c.findInRange(2, 10000, std::numeric_limits<int64_t>::max()));
+    EXPECT_EQ(97, c.get().rowId());
+    ASSERT_EQ(true, c.next());
+    EXPECT_EQ(false, c.findInRange(2, 10000, std::numeric_limits<int64_t>::max()));
+    EXPECT_EQ(99, c.get().rowId());
+}
+
+TEST(ColumnarRowBuffer, SpillToDisk) {
+    SpillOptions spill;
+    spill.dir = "/tmp";
+    size_t blockBytes = SmallColumnarBlock::create(makeLayout())->byteSize();
+    spill.memoryBytes = 3 * blockBytes;
+    spill.segmentBytes = 1024;
+    SmallColumnarBuffer buffer(1000, 1000000, 9600000ms, makeLayout(), OverflowPolicy::EVICT, spill);
+    SmallColumnarCursor c = buffer.getCursor();
+    for (int i=0; i < 100; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i), "tag" + std::to_string(i), i));
+    }
+    auto stats = buffer.stats();
+    EXPECT_EQ(100, stats.totalRows);
+    EXPECT_LT(0, stats.spilledBytes);
+    // Ten blocks' worth of rows, but only the tail's columns are in memory;
+    // the other nine keep less than half a block each.
+    EXPECT_GT(blockBytes + 9 * blockBytes / 2, stats.totalBytes);
+
+    // The cursor started out on a block that's since been spilled, and reads
+    // on through the spilled copies.
+    for (int j=0; j < 99; j++) {
+        ASSERT_EQ(j, c.get().rowId());
+        EXPECT_EQ("tag" + std::to_string(j), std::get<1>(c.get().column(1)).str());
+        ASSERT_EQ(true, c.next());
+    }
+    EXPECT_EQ(false, c.next());
+
+    auto c2 = buffer.getCursor(55ms);
+    EXPECT_EQ(55, c2.get().rowId());
+    EXPECT_EQ("tag55", std::get<1>(c2.get().column(1)).str());
+
+    // Spilled data counts against its own limit.
+    SpillOptions small = spill;
+    small.maxBytes = stats.spilledBytes / 2;
+    SmallColumnarBuffer bounded(1000, 1000000, 9600000ms, makeLayout(), OverflowPolicy::EVICT, small);
+    for (int i=0; i < 100; ++i) {
+        bounded.appendRow(makeRow(i, milliseconds(i), "tag" + std::to_string(i), i));
+    }
+    EXPECT_GE(small.maxBytes, bounded.stats().spilledBytes);
+    EXPECT_GT(100, bounded.stats().totalRows);
+}
+
+TEST(ColumnarRowBuffer, CompressBlocks) {
+    SmallColumnarBuffer buffer(1000, 1000000, 9600000ms, makeLayout(), OverflowPolicy::EVICT,
+                               SpillOptions{}, true);
+    SmallColumnarCursor c = buffer.getCursor();
+    for (int i=0; i < 100; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i), "tag" + std::to_string(i % 3), i));
+    }
+    // The compressor works in the background; its results are swapped in
+    // when the buffer next tidies up.
+    for (int wait=0; wait < 1000 && buffer.stats().compressedBlocks < 9; ++wait) {
+        std::this_thread::sleep_for(1ms);
+        buffer.adviseGC();
+    }
+    EXPECT_EQ(9, buffer.stats().compressedBlocks);
+    size_t blockBytes = SmallColumnarBlock::create(makeLayout())->byteSize();
+    EXPECT_GT(10 * blockBytes, buffer.stats().totalBytes);
+
+    // The cursor started out on a block that's since been compressed.
+    for (int j=0; j < 99; j++) {
+        ASSERT_EQ(j, c.get().rowId());
+        EXPECT_EQ("tag" + std::to_string(j % 3), std::get<1>(c.get().column(1)).str());
+        ASSERT_EQ(true, c.next());
+    }
+    EXPECT_EQ(false, c.next());
+
+    auto c2 = buffer.getCursor(55ms);
+    EXPECT_EQ(55, c2.get().rowId());
+    EXPECT_EQ("tag1", std::get<1>(c2.get().column(1)).str());
+}
+
+TEST(ColumnarRowBuffer, SingleWriterConcurrentReader) {
+    using LockFreeBlock = ColumnarRowBlockImpl<10, SingleWriterLock>;
+    // A small arena means many blocks get sealed before they're full.
+    RowBufferImpl<LockFreeBlock> buffer(100000, 100000000, 9600000ms, makeLayout(2));
+    const int totalRows = 5000;
+    std::thread reader([&buffer, totalRows]() {
+            RowCursorImpl<LockFreeBlock> c = buffer.getCursor();
+            buffer.waitForWrite(0);
+            int expected = 0;
+            while (expected < totalRows - 1) {
+                size_t seq = buffer.writeSequence();
+                ASSERT_EQ(true, c.get().valid());
+                ASSERT_EQ(expected, c.get().rowId());
+                ASSERT_EQ(std::to_string(expected), std::get<1>(c.get().column(1)).str());
+                if (c.next()) {
+                    expected++;
+                } else {
+                    buffer.waitForWrite(seq, 10ms);
+                }
+            }
+            });
+    for (int i=0; i < totalRows; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i), std::to_string(i), i));
+    }
+    reader.join();
+}
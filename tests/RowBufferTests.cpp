@@ -48,6 +48,29 @@ namespace {
     }
 }
 
+TEST(Row, OwnedColumns) {
+    Row r = makeRow(1, 10ms, { makeColumn("horsey"), makeColumn(7), makeColumn("merble") });
+    ASSERT_EQ(4, r.columns().size());
+    EXPECT_EQ("horsey", std::get<1>(r.columns()[1]).str());
+    EXPECT_EQ(7, std::get<2>(r.columns()[2]));
+    EXPECT_EQ("merble", std::get<1>(r.columns()[3]).str());
+}
+
+TEST(Row, SharedStorage) {
+    auto storage = std::make_shared<std::string>("10\036horsey");
+    folly::StringPiece text(*storage);
+    Row copy;
+    {
+        Row r(1, storage, { ColumnView(ColumnType::INTEGER, folly::StringPiece(), 10),
+                            ColumnView(ColumnType::TEXT, text.subpiece(3), -1) });
+        EXPECT_EQ(storage->data() + 3, std::get<1>(r.columns()[1]).data()) << "TEXT was copied";
+        copy = r;
+    }
+    storage.reset();
+    // The copy still keeps the storage alive.
+    EXPECT_EQ("horsey", std::get<1>(copy.columns()[1]).str());
+}
+
 TEST(RowBlock, OneInsert) {
     auto buffer = SmallRowBlock::create();
     Row r = makeRow(4, 10ms, { makeColumn("hello") });
@@ -89,11 +112,69 @@ TEST(RowBuffer, AppendExtend) {
     }
     auto stats = buffer.stats();
     EXPECT_EQ(15, stats.totalRows);
-    // 15 * 64 bytes
-    EXPECT_EQ(960, stats.totalBytes);
+    // Two blocks, plus each row's one column: 32 bytes asked of malloc, 48 given.
+    EXPECT_EQ(2 * SmallRowBlock::footprint() + 15 * 48, stats.totalBytes);
     EXPECT_EQ(2, stats.totalBlocks);
 }
 
+TEST(RowBuffer, SmallestLimits) {
+    size_t blockBytes = SmallRowBlock::footprint();
+    EXPECT_THROW(SmallRowBuffer(100, blockBytes - 1, 9600ms), std::invalid_argument);
+    EXPECT_THROW(SmallRowBuffer(100, 2 * blockBytes - 1, 9600ms, {}, OverflowPolicy::DROP),
+                 std::invalid_argument);
+
+    // The tail is over the limit on its own, and has to stay anyway.
+    SmallRowBuffer buffer(100, blockBytes, 9600ms);
+    for (int i=0; i < 5; ++i) {
+        EXPECT_EQ(true, buffer.appendRow(makeRow(i, milliseconds(i))));
+    }
+    EXPECT_EQ(5, buffer.totalRows());
+}
+
+TEST(RowBuffer, HardLimitDrop) {
+    size_t rowBytes = SmallRowBlock::rowBytes(makeRow(0, 0ms));
+    // Room for two blocks and 15 rows, nothing more.
+    size_t limit = 2 * SmallRowBlock::footprint() + 15 * rowBytes;
+    SmallRowBuffer buffer(100, limit, 9600ms, {}, OverflowPolicy::DROP);
+    SmallRowCursor c = buffer.getCursor();
+    vector<Row> batch;
+    for (int i=0; i < 20; ++i) {
+        batch.push_back(makeRow(i, milliseconds(i)));
+    }
+    EXPECT_EQ(false, buffer.appendRows(batch));
+    EXPECT_EQ(true, batch.empty());
+    EXPECT_EQ(false, buffer.appendRow(makeRow(20, 20ms)));
+
+    auto stats = buffer.stats();
+    EXPECT_EQ(15, stats.totalRows);
+    EXPECT_EQ(6, stats.droppedRows);
+    EXPECT_GE(limit, buffer.memoryBytes());
+}
+
+TEST(RowBuffer, HardLimitBackpressure) {
+    size_t limit = 3 * SmallRowBlock::footprint() + 30 * SmallRowBlock::rowBytes(makeRow(0, 0ms));
+    SmallRowBuffer buffer(100, limit, 9600ms, {}, OverflowPolicy::BACKPRESSURE);
+    vector<Row> batch;
+    for (int i=0; i < 40; ++i) {
+        batch.push_back(makeRow(i, milliseconds(i)));
+    }
+    {
+        // A cursor on the first block keeps it from being freed once evicted.
+        SmallRowCursor c = buffer.getCursor();
+        EXPECT_EQ(false, buffer.appendRows(batch));
+        EXPECT_LT(0, batch.size());
+        EXPECT_GT(40, batch.size());
+        EXPECT_EQ(0, buffer.stats().droppedRows);
+        EXPECT_EQ(false, buffer.appendRows(batch));
+        EXPECT_LT(0, buffer.stats().retiredBlocks);
+    }
+    // With the cursor gone, the rest go in.
+    EXPECT_EQ(true, buffer.appendRows(batch));
+    EXPECT_EQ(true, batch.empty());
+    EXPECT_EQ(39, buffer.getCursor(39ms).get().rowId());
+    EXPECT_GE(limit, buffer.memoryBytes());
+}
+
 TEST(RowBuffer, CursorLiveBlocks) {
     SmallRowBuffer buffer(30, 6000, 9600ms);
     auto minTs = 0ms;
@@ -115,6 +196,23 @@ TEST(RowBuffer, CursorLiveBlocks) {
     EXPECT_EQ(10, c2.get().rowId());
 }
 
+TEST(RowBuffer, CursorAtEnd) {
+    SmallRowBuffer buffer(30, 6000, 9600ms);
+    SmallRowCursor c = buffer.getCursor();
+    EXPECT_EQ(true, c.atEnd());
+    for (int i=0; i < 15; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i)));
+    }
+    // Across a block boundary, too.
+    for (int j=0; j < 14; j++) {
+        EXPECT_EQ(false, c.atEnd()) << "at row " << j;
+        EXPECT_EQ(true, c.next());
+    }
+    EXPECT_EQ(true, c.atEnd());
+    buffer.appendRow(makeRow(15, 15ms));
+    EXPECT_EQ(false, c.atEnd());
+}
+
 TEST(RowBuffer, CursorSeek) {
     SmallRowBuffer buffer(20, 3000, 9600ms);
     auto minTs = 0ms;
@@ -128,6 +226,76 @@ TEST(RowBuffer, CursorSeek) {
     EXPECT_EQ(11, c.get().rowId());
 }
 
+TEST(RowBuffer, CursorForTime) {
+    SmallRowBuffer buffer(100, 100000, 9600ms);
+    EXPECT_EQ(false, buffer.getCursor(5ms).get().valid()) << "empty buffer";
+    for (int i=0; i < 45; ++i) {
+        // Block 2 has one row out of order.
+        auto ts = i == 25 ? 1ms : milliseconds(i * 2);
+        buffer.appendRow(makeRow(i, ts));
+    }
+
+    EXPECT_EQ(0, buffer.getCursor(0ms).get().rowId());
+    EXPECT_EQ(6, buffer.getCursor(11ms).get().rowId());
+    EXPECT_EQ(6, buffer.getCursor(12ms).get().rowId());
+    EXPECT_EQ(26, buffer.getCursor(49ms).get().rowId());
+    EXPECT_EQ(40, buffer.getCursor(80ms).get().rowId());
+
+    // Nothing that new yet: the cursor waits on the last row.
+    SmallRowCursor c = buffer.getCursor(1000ms);
+    EXPECT_EQ(44, c.get().rowId());
+    EXPECT_EQ(false, c.next());
+    buffer.appendRow(makeRow(45, 1000ms));
+    EXPECT_EQ(true, c.next());
+    EXPECT_EQ(45, c.get().rowId());
+}
+
+TEST(RowBuffer, RetiredBlocksWaitForCursors) {
+    SmallRowBuffer buffer(20, 100000, 9600ms);
+    {
+        SmallRowCursor c = buffer.getCursor();
+        for (int i=0; i < 100; ++i) {
+            buffer.appendRow(makeRow(i, milliseconds(i)));
+        }
+        // The cursor still sits on the very first block, so nothing
+        // dropped from the buffer can be freed yet.
+        EXPECT_EQ(0, buffer.reclaim());
+        EXPECT_EQ(8, buffer.stats().retiredBlocks);
+        EXPECT_EQ(0, c.get().rowId());
+
+        // Walking off the first block keeps it, since the row the cursor
+        // just left may still be in use. Walking off the second lets
+        // exactly the first go.
+        while (c.get().rowId() < 10) {
+            ASSERT_EQ(true, c.next());
+        }
+        EXPECT_EQ(0, buffer.reclaim());
+        while (c.get().rowId() < 20) {
+            ASSERT_EQ(true, c.next());
+        }
+        EXPECT_EQ(1, buffer.reclaim());
+        EXPECT_EQ(7, buffer.stats().retiredBlocks);
+    }
+    EXPECT_EQ(7, buffer.reclaim());
+    EXPECT_EQ(0, buffer.stats().retiredBlocks);
+}
+
+TEST(RowBuffer, BlockPool) {
+    SmallRowBuffer buffer(20, 100000, 9600ms);
+    for (int i=0; i < 1000; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i)));
+    }
+    auto stats = buffer.stats();
+    EXPECT_EQ(100, stats.poolHits + stats.poolMisses);
+    // Once the first few blocks have been retired, every new block is reused.
+    EXPECT_GT(10, stats.poolMisses);
+
+    // Reused blocks read just like new ones.
+    SmallRowCursor c = buffer.getCursor();
+    EXPECT_EQ(980, c.get().rowId());
+    EXPECT_EQ(980ms, c.get().ts());
+}
+
 TEST(RowBuffer, ThreadUse) {
     SmallRowBuffer buffer(20, 3000, 9600ms);
     std::thread reader([&buffer]() {
@@ -146,3 +314,58 @@ TEST(RowBuffer, ThreadUse) {
     buffer.appendRow(makeRow(5, 34ms));
     reader.join();
 }
+
+TEST(RowBuffer, WaitForWriteSequence) {
+    SmallRowBuffer buffer(20, 3000, 9600ms);
+    size_t seq = buffer.writeSequence();
+    // A write that lands between taking the sequence and waiting must not be lost.
+    buffer.appendRow(makeRow(1, 30ms));
+    EXPECT_EQ(true, buffer.waitForWrite(seq, 10ms));
+    EXPECT_EQ(false, buffer.waitForWrite(buffer.writeSequence(), 10ms));
+}
+
+TEST(RowBuffer, AppendRowsBatch) {
+    SmallRowBuffer buffer(100, 6000, 9600ms);
+    SmallRowCursor c = buffer.getCursor();
+    size_t seq = buffer.writeSequence();
+    vector<Row> batch;
+    for (int i=0; i < 15; ++i) {
+        batch.push_back(makeRow(i, milliseconds(i)));
+    }
+    EXPECT_EQ(true, buffer.appendRows(batch));
+    EXPECT_EQ(seq + 1, buffer.writeSequence()) << "one wakeup per batch";
+    EXPECT_EQ(15, buffer.stats().totalRows);
+    EXPECT_EQ(2, buffer.stats().totalBlocks);
+
+    for (int j=0; j < 14; j++) {
+        EXPECT_EQ(j, c.get().rowId());
+        EXPECT_EQ(true, c.next());
+    }
+    EXPECT_EQ(14, c.get().rowId());
+    EXPECT_EQ(false, c.next());
+}
+
+TEST(RowBuffer, SingleWriterConcurrentReader) {
+    using LockFreeBlock = RowBlockImpl<10, SingleWriterLock>;
+    RowBufferImpl<LockFreeBlock> buffer(100000, 100000000, 9600000ms);
+    const int totalRows = 5000;
+    std::thread reader([&buffer, totalRows]() {
+            RowCursorImpl<LockFreeBlock> c = buffer.getCursor();
+            buffer.waitForWrite(0);
+            int expected = 0;
+            while (expected < totalRows - 1) {
+                size_t seq = buffer.writeSequence();
+                ASSERT_EQ(true, c.get().valid());
+                ASSERT_EQ(expected, c.get().rowId());
+                if (c.next()) {
+                    expected++;
+                } else {
+                    buffer.waitForWrite(seq, 10ms);
+                }
+            }
+            });
+    for (int i=0; i < totalRows; ++i) {
+        buffer.appendRow(makeRow(i, milliseconds(i)));
+    }
+    reader.join();
+}
@@ -0,0 +1,84 @@
+#include "setab/RowParser.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+    const vector<ColumnType> schema = {
+        ColumnType::INTEGER,
+        ColumnType::TEXT,
+        ColumnType::INTEGER,
+    };
+    const ParserIsa allIsas[] = { ParserIsa::SCALAR, ParserIsa::SSE42, ParserIsa::AVX2 };
+
+    bool parseInteger(const TextRowParser& p, const std::string& s, int64_t& out) {
+        // Pad past the end so that the vector paths get a chance to run.
+        std::string padded = s + std::string(32, 'x');
+        return p.parseInteger(padded.data(), padded.data() + s.size(), padded.data() + padded.size(), out);
+    }
+}
+
+TEST(TextRowParser, ParseRow) {
+    for (auto isa : allIsas) {
+        TextRowParser p(schema, isa);
+        std::string data = "1457341732991\036blamo mac-n-cheese\0363402";
+        vector<ColumnView> cols;
+        ASSERT_EQ(ParseStatus::OK, p.parse(data, cols)) << parserIsaName(p.isa());
+        ASSERT_EQ(3, cols.size());
+        EXPECT_EQ(1457341732991, std::get<2>(cols[0]));
+        EXPECT_EQ("blamo mac-n-cheese", std::get<1>(cols[1]).str());
+        EXPECT_EQ(data.data() + 14, std::get<1>(cols[1]).data()) << "TEXT should be a view";
+        EXPECT_EQ(3402, std::get<2>(cols[2]));
+    }
+}
+
+TEST(TextRowParser, BadRows) {
+    for (auto isa : allIsas) {
+        TextRowParser p(schema, isa);
+        vector<ColumnView> cols;
+        EXPECT_EQ(ParseStatus::WRONG_COLUMN_COUNT, p.parse(std::string("1\036horsey"), cols));
+        cols.clear();
+        EXPECT_EQ(ParseStatus::WRONG_COLUMN_COUNT, p.parse(std::string("1\036horsey\0362\0363"), cols));
+        cols.clear();
+        EXPECT_EQ(ParseStatus::BAD_INTEGER, p.parse(std::string("1\036horsey\036fast"), cols));
+        cols.clear();
+        EXPECT_EQ(ParseStatus::BAD_INTEGER, p.parse(std::string("\036horsey\0362"), cols));
+    }
+}
+
+TEST(TextRowParser, FindSeparator) {
+    for (auto isa : allIsas) {
+        TextRowParser p(schema, isa);
+        std::string data(100, 'a');
+        EXPECT_EQ(data.data() + data.size(), p.findSeparator(data.data(), data.data() + data.size()));
+        for (size_t at : {0, 15, 16, 31, 32, 33, 99}) {
+            std::string withSep = data;
+            withSep[at] = ColSep;
+            EXPECT_EQ(withSep.data() + at, p.findSeparator(withSep.data(), withSep.data() + withSep.size()))
+                << parserIsaName(p.isa()) << " at " << at;
+        }
+    }
+}
+
+TEST(TextRowParser, Integers) {
+    const std::vector<std::pair<std::string, int64_t>> good = {
+        {"0", 0}, {"7", 7}, {"-7", -7}, {"1234567890123456", 1234567890123456},
+        {"-9999999999999999", -9999999999999999}, {"12345678901234567", 12345678901234567},
+        {"9223372036854775807", 9223372036854775807LL},
+        {"-9223372036854775808", std::numeric_limits<int64_t>::min()},
+    };
+    const std::vector<std::string> bad = {
+        "", "-", "12a4", "1.5", " 12", "9223372036854775808", "-9223372036854775809", "1234567890123456/",
+    };
+    for (auto isa : allIsas) {
+        TextRowParser p(schema, isa);
+        for (const auto& g : good) {
+            int64_t out = -1;
+            EXPECT_EQ(true, parseInteger(p, g.first, out)) << parserIsaName(p.isa()) << " " << g.first;
+            EXPECT_EQ(g.second, out) << parserIsaName(p.isa()) << " " << g.first;
+        }
+        for (const auto& b : bad) {
+            int64_t out;
+            EXPECT_EQ(false, parseInteger(p, b, out)) << parserIsaName(p.isa()) << " '" << b << "'";
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#include "setab/WireFormat.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+    const vector<Column> schema = {
+        {"ts", ColumnType::INTEGER},
+        {"tag", ColumnType::TEXT},
+        {"latency", ColumnType::INTEGER},
+    };
+}
+
+TEST(WireFormat, RoundTrip) {
+    string data;
+    wire::appendInteger(data, 1457341732991);
+    wire::appendText(data, string("horsey\036with a separator"));
+    wire::appendInteger(data, -42);
+    EXPECT_EQ(8 + 4 + 23 + 8, data.size());
+
+    vector<ColumnView> cols;
+    ASSERT_EQ(true, wire::decodeRow(data, schema, cols));
+    ASSERT_EQ(3, cols.size());
+    EXPECT_EQ(1457341732991, std::get<2>(cols[0]));
+    EXPECT_EQ("horsey\036with a separator", std::get<1>(cols[1]).str());
+    EXPECT_EQ(-42, std::get<2>(cols[2]));
+}
+
+TEST(WireFormat, RejectsMalformed) {
+    string data;
+    wire::appendInteger(data, 1);
+    wire::appendText(data, "mass-blaster");
+    wire::appendInteger(data, 2);
+
+    vector<ColumnView> cols;
+    EXPECT_EQ(false, wire::decodeRow(folly::StringPiece(data).subpiece(0, data.size() - 1), schema, cols));
+    cols.clear();
+    EXPECT_EQ(false, wire::decodeRow(data + "x", schema, cols));
+}
+
+TEST(WireFormat, ParseName) {
+    EXPECT_EQ(WireFormat::BINARY, parseWireFormat(" 'binary'"));
+    EXPECT_EQ(WireFormat::TEXT, parseWireFormat("TEXT"));
+    EXPECT_THROW(parseWireFormat("json"), std::invalid_argument);
+}
+
+TEST(WireFormat, SplitRows) {
+    string rows = "1\036horsey\036-42";
+    string second;
+    wire::appendInteger(second, 2);
+    rows += second;
+    string lengths;
+    wire::appendLength(lengths, rows.size() - second.size());
+    wire::appendLength(lengths, second.size());
+
+    vector<folly::StringPiece> out;
+    EXPECT_EQ(true, wire::splitRows(lengths, rows, out));
+    ASSERT_EQ(2, out.size());
+    EXPECT_EQ("1\036horsey\036-42", out[0].str());
+    EXPECT_EQ(second, out[1].str());
+
+    out.clear();
+    EXPECT_EQ(false, wire::splitRows(lengths, rows + "x", out));
+    out.clear();
+    EXPECT_EQ(false, wire::splitRows(lengths.substr(1), rows, out));
+}